@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lz4hc.h"
+
+#define MINMATCH 4
+#define LASTLITERALS 5 // 块尾5字节必须是字面量
+#define MFLIMIT 12 // 最后一个匹配至少在块尾12字节之前开始
+#define MAX_DISTANCE 65535
+#define HASH_LOG 16
+#define NO_POS 0xFFFFFFFF
+#define OPT_MAX_LENGTHS 64 // 最优解析逐个尝试的匹配长度上限, 更长的只试最长
+#define LONG_MATCH 256 // 上个位置的匹配超过此长度时直接沿用(长度减1), 避免长串重复数据上逐位置比较成平方复杂度
+
+static uint32_t hash4(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// 长度字段超过15的部分用255串表示
+static uint32_t length_extra_bytes(uint32_t len)
+{
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static void reserve_state(lz4hc_state* state, size_t size)
+{
+    if (!state->head) {
+        state->head = (uint32_t*)malloc(sizeof(uint32_t) << HASH_LOG);
+    }
+    if (size > state->capacity) {
+        free(state->prev);
+        free(state->matchlen);
+        free(state->matchoff);
+        free(state->cost);
+        free(state->choice);
+        state->prev = (uint32_t*)malloc(sizeof(uint32_t) * size);
+        state->matchlen = (uint32_t*)malloc(sizeof(uint32_t) * size);
+        state->matchoff = (uint16_t*)malloc(sizeof(uint16_t) * size);
+        state->cost = (uint32_t*)malloc(sizeof(uint32_t) * (size + 1));
+        state->choice = (uint32_t*)malloc(sizeof(uint32_t) * size);
+        state->capacity = size;
+    }
+}
+
+void lz4hc_free(lz4hc_state* state)
+{
+    free(state->head);
+    free(state->prev);
+    free(state->matchlen);
+    free(state->matchoff);
+    free(state->cost);
+    free(state->choice);
+    memset(state, 0, sizeof(lz4hc_state));
+}
+
+size_t lz4_compress_bound(size_t srcsize)
+{
+    return srcsize + srcsize / 255 + 16;
+}
+
+// 哈希链找出每个位置的最长匹配
+static void find_matches(lz4hc_state* state, const uint8_t* src, size_t srcsize, int depth)
+{
+    size_t mflimit = srcsize - MFLIMIT;
+    size_t matchlimit = srcsize - LASTLITERALS;
+    memset(state->head, 0xFF, sizeof(uint32_t) << HASH_LOG);
+    for (size_t pos = 0; pos < mflimit; pos++) {
+        uint32_t h = hash4(src + pos);
+        uint32_t cand = state->head[h];
+        uint32_t bestlen = 0, bestoff = 0;
+        state->prev[pos] = cand;
+        state->head[h] = (uint32_t)pos;
+        if (pos > 0 && state->matchlen[pos - 1] > LONG_MATCH) {
+            state->matchlen[pos] = state->matchlen[pos - 1] - 1;
+            state->matchoff[pos] = state->matchoff[pos - 1];
+            continue;
+        }
+        for (int d = depth; d > 0 && cand != NO_POS && pos - cand <= MAX_DISTANCE; d--, cand = state->prev[cand]) {
+            // 先比较当前最长匹配的下一个字节, 不可能更长的直接跳过
+            if (pos + bestlen >= matchlimit || src[cand + bestlen] != src[pos + bestlen]) {
+                continue;
+            }
+            const uint8_t* p = src + pos;
+            const uint8_t* q = src + cand;
+            const uint8_t* end = src + matchlimit;
+            while (p < end && *p == *q) {
+                p++;
+                q++;
+            }
+            uint32_t len = (uint32_t)(p - (src + pos));
+            if (len > bestlen) {
+                bestlen = len;
+                bestoff = (uint32_t)(pos - cand);
+                if (pos + len == matchlimit) {
+                    break;
+                }
+            }
+        }
+        state->matchlen[pos] = bestlen >= MINMATCH ? bestlen : 0;
+        state->matchoff[pos] = (uint16_t)bestoff;
+    }
+    for (size_t pos = mflimit; pos < srcsize; pos++) {
+        state->matchlen[pos] = 0;
+    }
+}
+
+// 从块尾往前算每个位置的最小输出字节数: 字面量记1字节, 匹配记token加2字节距离加长度扩展字节,
+// 字面量串的长度扩展字节每255个才多1字节, 忽略不计. 同样大小时选匹配, 序列少解压快
+static void optimal_parse(lz4hc_state* state, size_t srcsize)
+{
+    uint32_t* cost = state->cost;
+    cost[srcsize] = 0;
+    for (size_t pos = srcsize; pos-- > 0;) {
+        uint32_t best = cost[pos + 1] + 1;
+        uint32_t choice = 0;
+        uint32_t maxlen = state->matchlen[pos];
+        for (uint32_t len = MINMATCH; len <= maxlen; len++) {
+            if (len > OPT_MAX_LENGTHS && len < maxlen) {
+                len = maxlen;
+            }
+            uint32_t c = cost[pos + len] + 3 + length_extra_bytes(len - MINMATCH);
+            if (c <= best) {
+                best = c;
+                choice = len;
+            }
+        }
+        cost[pos] = best;
+        state->choice[pos] = choice;
+    }
+}
+
+static uint8_t* write_length(uint8_t* op, uint32_t len)
+{
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// 写一个序列, 匹配长度为0时是块尾的字面量. dst放不下返回NULL
+static uint8_t* write_sequence(uint8_t* op, const uint8_t* opend, const uint8_t* literals, uint32_t litlen, uint32_t offset, uint32_t matchlen)
+{
+    uint32_t mlcode = matchlen ? matchlen - MINMATCH : 0;
+    size_t need = 1 + length_extra_bytes(litlen) + litlen + (matchlen ? 2 + length_extra_bytes(mlcode) : 0);
+    if ((size_t)(opend - op) < need) {
+        return NULL;
+    }
+    uint8_t* token = op++;
+    *token = (uint8_t)((litlen < 15 ? litlen : 15) << 4);
+    if (litlen >= 15) {
+        op = write_length(op, litlen);
+    }
+    memcpy(op, literals, litlen);
+    op += litlen;
+    if (matchlen) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)(mlcode < 15 ? mlcode : 15);
+        if (mlcode >= 15) {
+            op = write_length(op, mlcode);
+        }
+    }
+    return op;
+}
+
+size_t lz4hc_compress(lz4hc_state* state, const void* src, size_t srcsize, void* dst, size_t dstcapacity, int depth)
+{
+    const uint8_t* ip = (const uint8_t*)src;
+    uint8_t* op = (uint8_t*)dst;
+    const uint8_t* opend = op + dstcapacity;
+    size_t anchor = 0;
+    if (srcsize > MFLIMIT) {
+        reserve_state(state, srcsize);
+        find_matches(state, ip, srcsize, depth);
+        optimal_parse(state, srcsize);
+        for (size_t pos = 0; pos < srcsize;) {
+            uint32_t len = state->choice[pos];
+            if (!len) {
+                pos++;
+                continue;
+            }
+            op = write_sequence(op, opend, ip + anchor, (uint32_t)(pos - anchor), state->matchoff[pos], len);
+            if (!op) {
+                return 0;
+            }
+            pos += len;
+            anchor = pos;
+        }
+    }
+    op = write_sequence(op, opend, ip + anchor, (uint32_t)(srcsize - anchor), 0, 0);
+    return op ? (size_t)(op - (uint8_t*)dst) : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef LZ4HC_H
+#define LZ4HC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 只实现squashfs要的LZ4块格式编码(不带帧头), 解码由内核的LZ4_decompress_safe完成
+// 匹配用64K窗口的哈希链查找, 再按LZ4的字节开销从后往前做最优解析
+
+#define LZ4HC_DEFAULT_DEPTH 256 // 每个位置最多查找的哈希链节点数
+
+typedef struct lz4hc_state
+{
+    uint32_t* head;     // 每个哈希值最近的位置
+    uint32_t* prev;     // 同哈希的上一个位置
+    uint32_t* matchlen; // 每个位置的最长匹配, 小于4为0
+    uint16_t* matchoff; // 对应的距离
+    uint32_t* cost;     // 从该位置到块尾的最小输出字节数
+    uint32_t* choice;   // 该位置选用的匹配长度, 0为字面量
+    size_t capacity;    // 以上按位置的数组的长度
+} lz4hc_state;
+
+// state清零即可使用, 工作内存按块大小自动扩大, 用完调用lz4hc_free
+void lz4hc_free(lz4hc_state* state);
+
+// 最坏情况(全部字面量)的输出大小
+size_t lz4_compress_bound(size_t srcsize);
+
+// 返回压缩大小, dstcapacity放不下时返回0
+size_t lz4hc_compress(lz4hc_state* state, const void* src, size_t srcsize, void* dst, size_t dstcapacity, int depth);
+
+#endif
@@ -10,9 +10,10 @@
 #ifdef USE_ZOPFLI
 #include "zopfli/zopfli.h"
 #include "zopfli/zlib_container.h"
-#else
-#include <zlib.h>
+#include "zopfli/checksum.h"
 #endif
+#include <zlib.h>
+#include "lz4/lz4hc.h"
 #include "squashfs.h"
 
 
@@ -23,6 +24,11 @@
 #define INITIAL_BLOCK_CAPACITY 100
 #define ARRAYCOUNT_INCREMENTAL 16
 #define ELF_MAGIC 0x464C457F
+#define FRAGMENT_LOOKAHEAD 64 // 碎片装箱每次向前看的尾块数
+#define FRAGMENT_OPEN_BINS 16 // 装箱时最多同时保持未满的碎片块数, 也是写盘时缓存的碎片块数上限
+#define FRAGMENT_SAMPLE 4096 // 算相似度特征时每个尾块最多读取的字节数
+#define FRAGMENT_MINHASH 16 // MinHash签名长度
+#define FRAGMENT_SIMILAR 40 // 相似度(0~100)达到此值的未满碎片块优先接收尾块, 都不到时才考虑另开碎片块
 
 #ifdef _VERBOSE
 #define verbose(fmt,...) printf(fmt, ##__VA_ARGS__)
@@ -63,6 +69,14 @@ typedef struct bytevec
     size_t cap;
 } bytevec;
 
+// 边生成边压缩的metadata表(inode table, directory table)
+typedef struct metatable
+{
+    bytevec plain; // 明文
+    bytevec zdata; // 已压缩的metablock, 带2字节长度头
+    size_t flushed; // plain中已压缩的长度
+} metatable;
+
 typedef struct stringtable
 {
     char* data;
@@ -75,27 +89,96 @@ typedef struct stringtable
 
 size_t g_BLOCK_SIZE = 128*1024;
 bool g_tailends = true;
+bool g_fraggroup = true; // 按内容相似度给尾块分组装箱
 bool g_zerotime = true;
 bool g_autoexec = true;
 bool g_newinoderules = true;
 int g_opkfd;
 int g_root_inode;
-size_t g_block_offset;
+uint64_t g_block_offset; // 镜像可超过4G, Win32下size_t不够
 uint64_t g_raw_filesizes = 0;
 nodeitem* g_nodes;
 int g_nodesize = 0;
 struct squashfs_super_block sb;
 uint32_t g_mkfs_time = 0;
+uint32_t g_num_cores = 1;
+#ifdef USE_ZOPFLI
+// 分级压缩档位: 贪心LZ77(接近zlib -9), 单次迭代(只用来估计收益), 完整zopfli
+enum { TIER_GREEDY, TIER_ONE, TIER_FULL, TIER_COUNT };
+typedef struct tierstat
+{
+    uint32_t blocks;   // 最终采用该档输出的块数
+    uint64_t rawbytes; // 这些块的原始大小
+    uint64_t zbytes;   // 这些块的压缩后大小
+    double seconds;    // 该档所有试压耗时, 包括没被采用的
+} tierstat;
+tierstat g_tiers[TIER_COUNT];
+double g_gain_threshold = 0; // -gain: 预测完整zopfli每CPU秒能多省的字节数达到此值才跑, 0为不试压直接完整zopfli
+int g_warm_iterations = 0; // -warmstart: 同一文件的后续块从前面块收敛的统计开始, 只跑这么多次迭代, 0为关闭
+bool g_fast = false; // -fast: 完整档换成单次搜索加单次代价模型的快速解析, 日常构建用
+double g_decodecost = 0; // -decodecost: 每步inflate解码折算的比特数, 换更快的设备端解压, 0为只看大小
+#endif
+// zlib的几种试压参数, 第一种等同compress2(Z_BEST_COMPRESSION)
+#define ZATTEMPT_COUNT 4
+static const struct { int memlevel; int strategy; } g_zattempts[ZATTEMPT_COUNT] = {
+    {8, Z_DEFAULT_STRATEGY}, {8, Z_FILTERED}, {8, Z_RLE}, {9, Z_DEFAULT_STRATEGY},
+};
+// 每个压缩线程一套z_stream, 按需初始化, 之后每块只deflateReset不重新分配
+typedef struct zcontext
+{
+    z_stream strm[ZATTEMPT_COUNT];
+    bool inited[ZATTEMPT_COUNT];
+    void* scratch; // 多策略时后面几次试压的输出, 更小才拷到out
+    size_t scratchsize;
+} zcontext;
+bool g_multistrategy = false; // -strategies: 每块试全部参数取最小, 默认只试第一种
+
+// 每个压缩线程一个上下文: 各后端复用的状态, 加上调用方每次压缩前设置的参数
+typedef struct compressctx
+{
+    zcontext z;
+    lz4hc_state lz4;
+    int splitthreads; // 本次压缩可用的线程数
+    const uint32_t* adler; // 调用方已增量算好的adler32, 为NULL则后端需要时自己计算
+#ifdef USE_ZOPFLI
+    ZopfliStatsPrior* prior; // 热启动统计, NULL为冷启动
+    tierstat* tiers; // 分级统计累加处, NULL为g_tiers
+#endif
+} compressctx;
+compressctx g_cmain; // 主线程(碎片块和元数据块)用
+
+// 压缩后端, 镜像格式由-comp在运行时选择
+typedef struct compressor
+{
+    const wchar_t* name; // -comp的参数
+    uint16_t id; // sb.compression
+    size_t (*bound)(size_t blocksize); // 输出最坏大小, 调用方按此分配out
+    size_t (*compress)(compressctx* ctx, const void* block, size_t blocksize, void* out); // 返回压缩大小, 失败返回0
+    size_t (*options)(void* buf); // 填写压缩器选项块(SQUASHFS_COMPRESSOR_OPTIONS), 返回长度, 0为不写
+    bool needadler; // 需要数据的adler32(自己写zlib容器), 调用方读入数据时顺便算好经ctx->adler传入
+} compressor;
+const compressor* g_compressor;
+#ifdef USE_ZOPFLI
+#define DEFAULT_COMPRESSOR L"zopfli"
+#else
+#define DEFAULT_COMPRESSOR L"zlib"
+#endif
 
 void save_data_blocks();
+const compressor* find_compressor(const wchar_t* name);
 char* unicode_to_utf8(const wchar_t* source);
 void add_to_stringtable(stringtable* table, const void* str);
 const void* pop_from_stringtable(stringtable* table); // revoke last item
 void free_stringtable(stringtable* table);
 void append_bytevec(bytevec* vec, const void* buf, size_t len);
 void* alloc_bytevec(bytevec* vec, size_t len);
-size_t compress_to_file(void* block, size_t blocksize, bool ismeta);
+size_t compress_to_file(void* block, size_t blocksize, bool ismeta, const uint32_t* adler);
 uint64_t compress_meta_blocks(void* buf, size_t len, bool withoffsets);
+void flush_meta_blocks(metatable* table, bool final);
+uint64_t metatable_ref(const metatable* table);
+#ifdef USE_ZOPFLI
+void print_tier_report();
+#endif
 
 long generate_inode_num()
 {
@@ -416,6 +499,7 @@ int wmain(int argc, wchar_t ** argv)
         printf("Usage: opack <input_directory> <output_file> [options]\n");
         return 1;
     }
+    g_compressor = find_compressor(DEFAULT_COMPRESSOR);
     for (int i = 3; i < argc; i++) {
         if (wcsicmp(argv[i], L"-real-time") == 0) {
             g_zerotime = false;
@@ -426,6 +510,9 @@ int wmain(int argc, wchar_t ** argv)
         if (wcsicmp(argv[i], L"-no-tailends") == 0) {
             g_tailends = false;
         }
+        if (wcsicmp(argv[i], L"-no-fraggroup") == 0) {
+            g_fraggroup = false;
+        }
         if (wcsicmp(argv[i], L"-old-inodenum") == 0) {
             g_newinoderules = false;
         }
@@ -439,6 +526,30 @@ int wmain(int argc, wchar_t ** argv)
             }
             g_BLOCK_SIZE = _wtol(blocksize) * mulfac;
         }
+#ifdef USE_ZOPFLI
+        if (wcsicmp(argv[i], L"-gain") == 0) {
+            g_gain_threshold = _wtof(argv[++i]);
+        }
+        if (wcsicmp(argv[i], L"-warmstart") == 0) {
+            g_warm_iterations = _wtol(argv[++i]);
+        }
+        if (wcsicmp(argv[i], L"-fast") == 0) {
+            g_fast = true;
+        }
+        if (wcsicmp(argv[i], L"-decodecost") == 0) {
+            g_decodecost = _wtof(argv[++i]);
+        }
+#endif
+        if (wcsicmp(argv[i], L"-strategies") == 0) {
+            g_multistrategy = true;
+        }
+        if (wcsicmp(argv[i], L"-comp") == 0) {
+            g_compressor = find_compressor(argv[++i]);
+            if (!g_compressor) {
+                printf("Unknown compressor %S\n", argv[i]);
+                return 1;
+            }
+        }
     }
 
     // 首先扫描目录
@@ -477,22 +588,33 @@ int wmain(int argc, wchar_t ** argv)
     // 跳过superblock
     _lseek(g_opkfd, sizeof(struct squashfs_super_block), SEEK_SET);
     g_block_offset = sizeof(struct squashfs_super_block);
+    // 压缩器选项块紧跟superblock, 存成未压缩的元数据块
+    uint8_t compopts[2 + 64];
+    size_t compoptsize = g_compressor->options(compopts + 2);
+    if (compoptsize) {
+        *(uint16_t*)compopts = (uint16_t)compoptsize | 0x8000;
+        g_block_offset += _write(g_opkfd, compopts, 2 + compoptsize);
+    }
+    uint64_t datastart = g_block_offset;
 
     save_data_blocks();
 
     free_nodes();
 
-    uint64_t compressedfilesize = sb.inode_table_start - sizeof(struct squashfs_super_block);
+    uint64_t compressedfilesize = sb.inode_table_start - datastart;
     uint64_t mkfsoverhead = g_block_offset - compressedfilesize;
     printf("files body %I64u -> %I64u, compression ratio: %f\nmkfs overhead: %I64u bytes\n", g_raw_filesizes, compressedfilesize, (double)compressedfilesize / g_raw_filesizes, mkfsoverhead);
+#ifdef USE_ZOPFLI
+    print_tier_report();
+#endif
 
     sb.s_magic = SQUASHFS_MAGIC; // 'sqsh';
     sb.s_major = SQUASHFS_MAJOR;
     sb.s_minor = SQUASHFS_MINOR;
-    sb.flags = SQUASHFS_DUPLICATES; // 0x40
+    sb.flags = SQUASHFS_DUPLICATES | (compoptsize ? SQUASHFS_COMPRESSOR_OPTIONS : 0); // 0x40
     sb.block_size = g_BLOCK_SIZE;
     sb.block_log = 31 - _lzcnt_u32(g_BLOCK_SIZE); //log2(g_BLOCK_SIZE);
-    sb.compression = ZLIB_COMPRESSION; // 1
+    sb.compression = g_compressor->id;
     sb.no_ids = 1;
     sb.lookup_table_start = -1;
     sb.xattr_id_table_start = -1;
@@ -501,29 +623,215 @@ int wmain(int argc, wchar_t ** argv)
     _lseek(g_opkfd, 0, SEEK_SET);
     _write(g_opkfd, &sb, sizeof(sb)); // 更新superblock
 
-    _chsize(g_opkfd, ((g_block_offset + 4095) / 4096) * 4096); // 按照4K对齐
+    _chsize_s(g_opkfd, ((g_block_offset + 4095) / 4096) * 4096); // 按照4K对齐
 
     _close(g_opkfd);
 }
 
-size_t compress_to_file(void* block, size_t blocksize, bool ismeta)
+#ifdef USE_ZOPFLI
+// 完整zopfli比两档试压中较小者多省的字节, 约为单次迭代比贪心省的字节的倍数(样本块统计, 相关性不强, 只作粗估)
+#define FULL_GAIN_RATIO 0.1
+// 完整zopfli耗时约为两档试压合计耗时的倍数, 试压也分块, 与完整档相当
+#define FULL_TIME_RATIO 1.0
+
+// prior: 完整档从中热启动, 有效时迭代次数换成g_warm_iterations
+void init_tier_options(ZopfliOptions* options, int tier, int splitthreads, ZopfliStatsPrior* prior)
+{
+    ZopfliInitOptions(options);
+    options->matchfinder = ZOPFLI_MATCHFINDER_BINARY_TREE; // 二叉树找匹配, 重复数据上比哈希链快
+    options->blocksplittingthreads = splitthreads;
+    options->decodecost = g_decodecost;
+    switch (tier) {
+    case TIER_GREEDY:
+        options->numiterations = 0; // 只跑贪心LZ77和分块
+        break;
+    case TIER_ONE:
+        options->numiterations = 1; // 与贪心档同样分块, 两者之差才只是迭代的收益
+        break;
+    default:
+        options->numiterations = prior && prior->valid ? g_warm_iterations : 15;
+        options->matchtable = 1; // 每块只找一次匹配, 迭代只跑DP
+        options->warmstart = prior;
+        options->fast = g_fast;
+        break;
+    }
+}
+
+// 按档位压缩一块, 返回zlib流长度, *zblock需调用方释放
+// g_gain_threshold为0时直接完整zopfli; 否则先试压贪心和单次迭代两档, 按两者差距预测完整zopfli的收益,
+// 每CPU秒预计能省的字节达到阈值才跑完整zopfli, 最后取最小的输出
+size_t compress_block_tiered(const void* block, size_t blocksize, uint32_t adler, int splitthreads, ZopfliStatsPrior* prior, unsigned char** zblock, tierstat* tiers)
+{
+    size_t probesize[TIER_FULL];
+    double probetime = 0;
+    int besttier = TIER_FULL;
+    size_t bestsize = 0;
+    *zblock = NULL;
+    for (int tier = g_gain_threshold > 0 ? TIER_GREEDY : TIER_FULL; tier < TIER_COUNT; tier++) {
+        if (tier == TIER_FULL && g_gain_threshold > 0) {
+            double gain = probesize[TIER_GREEDY] > probesize[TIER_ONE] ? (probesize[TIER_GREEDY] - probesize[TIER_ONE]) * FULL_GAIN_RATIO : 0;
+            if (gain < g_gain_threshold * probetime * FULL_TIME_RATIO) {
+                break;
+            }
+        }
+        ZopfliOptions options;
+        init_tier_options(&options, tier, splitthreads, prior);
+        unsigned char* out = NULL;
+        size_t outsize = 0;
+        LARGE_INTEGER freq, start, end;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&start);
+        ZopfliZlibCompressAdler32(&options, (const unsigned char*)block, blocksize, adler, &out, &outsize);
+        QueryPerformanceCounter(&end);
+        double seconds = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+        tiers[tier].seconds += seconds;
+        if (tier < TIER_FULL) {
+            probesize[tier] = outsize;
+            probetime += seconds;
+        }
+        if (!*zblock || outsize < bestsize) {
+            free(*zblock);
+            *zblock = out;
+            bestsize = outsize;
+            besttier = tier;
+        } else {
+            free(out);
+        }
+    }
+    tiers[besttier].blocks++;
+    tiers[besttier].rawbytes += blocksize;
+    tiers[besttier].zbytes += bestsize;
+    return bestsize;
+}
+
+void print_tier_report()
+{
+    const char* names[TIER_COUNT] = {"greedy", "1 iter", "full"};
+    if (!g_tiers[TIER_GREEDY].blocks && !g_tiers[TIER_ONE].blocks && !g_tiers[TIER_FULL].blocks) {
+        return; // 没用zopfli后端
+    }
+    printf("tier    blocks        raw ->   compressed   cpu seconds\n");
+    for (int i = 0; i < TIER_COUNT; i++) {
+        printf("%-6s %7u %10I64u -> %10I64u %12.2f\n", names[i], g_tiers[i].blocks, g_tiers[i].rawbytes, g_tiers[i].zbytes, g_tiers[i].seconds);
+    }
+}
+
+size_t zopfli_compress(compressctx* ctx, const void* block, size_t blocksize, void* out)
+{
+    unsigned char* zblock;
+    uint32_t adler = ctx->adler ? *ctx->adler : ZopfliUpdateAdler32(ZOPFLI_ADLER32_INIT, (const unsigned char*)block, blocksize);
+    size_t zsize = compress_block_tiered(block, blocksize, adler, ctx->splitthreads, ctx->prior, &zblock, ctx->tiers ? ctx->tiers : g_tiers);
+    if (zsize <= compressBound(blocksize)) {
+        memcpy(out, zblock, zsize);
+    } else {
+        zsize = 0;
+    }
+    free(zblock);
+    return zsize;
+}
+#endif
+
+size_t zlib_bound(size_t blocksize)
+{
+    return compressBound(blocksize);
+}
+
+// 用ctx里复用的流压缩一块, 多策略时取最小的结果
+size_t zlib_compress(compressctx* cctx, const void* block, size_t blocksize, void* out)
 {
-    bool compressed;
+    zcontext* ctx = &cctx->z;
+    uLong bound = compressBound(blocksize);
+    uLong bestsize = 0;
+    for (int i = 0; i < (g_multistrategy ? ZATTEMPT_COUNT : 1); i++) {
+        z_stream* strm = &ctx->strm[i];
+        if (!ctx->inited[i]) {
+            memset(strm, 0, sizeof(z_stream));
+            if (deflateInit2(strm, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS, g_zattempts[i].memlevel, g_zattempts[i].strategy) != Z_OK) {
+                continue;
+            }
+            ctx->inited[i] = true;
+        } else {
+            deflateReset(strm);
+        }
+        // 第一次成功的直接写进out, 之后的写到scratch
+        if (bestsize && ctx->scratchsize < bound) {
+            free(ctx->scratch);
+            ctx->scratch = malloc(bound);
+            ctx->scratchsize = bound;
+        }
+        strm->next_in = (Bytef*)block;
+        strm->avail_in = blocksize;
+        strm->next_out = bestsize ? ctx->scratch : out;
+        strm->avail_out = bound; // 超出compressBound的试压一定比原始数据大, 放不下当作失败
+        if (deflate(strm, Z_FINISH) == Z_STREAM_END && (!bestsize || strm->total_out < bestsize)) {
+            if (bestsize) {
+                memcpy(out, ctx->scratch, strm->total_out);
+            }
+            bestsize = strm->total_out;
+        }
+    }
+    return bestsize;
+}
+
+size_t zlib_options(void* buf)
+{
+    return 0; // gzip选项块可选, 内核不看
+}
+
+size_t lz4_compress(compressctx* ctx, const void* block, size_t blocksize, void* out)
+{
+    return lz4hc_compress(&ctx->lz4, block, blocksize, out, lz4_compress_bound(blocksize), LZ4HC_DEFAULT_DEPTH);
+}
+
+// 内核要求LZ4镜像必须带选项块: version为LZ4_LEGACY(1), flags为LZ4_HC(1)
+size_t lz4_options(void* buf)
+{
+    uint32_t* opts = (uint32_t*)buf;
+    opts[0] = 1; // little endian
+    opts[1] = 1;
+    return 2 * sizeof(uint32_t);
+}
+
+const compressor g_compressors[] = {
+    {L"zlib", ZLIB_COMPRESSION, zlib_bound, zlib_compress, zlib_options, false}, // zlib库压缩时自己算adler32
 #ifdef USE_ZOPFLI
-    ZopfliOptions options;
-    ZopfliInitOptions(&options);
-    options.numiterations = 15;
-    unsigned char* zblock = NULL;
-    size_t zsize = 0;
-    ZopfliZlibCompress(&options, (unsigned char*)block, blocksize, &zblock, &zsize);
-    compressed = zsize < blocksize;
-#else
-    uLong zsize = compressBound(blocksize);
-    void* zblock = malloc(zsize);
-    int ret = compress2(zblock, &zsize, block, blocksize, Z_BEST_COMPRESSION); //compressData(block, g_BLOCK_SIZE, &zblock, &zsize);
-    compressed = ret == Z_OK && zsize < blocksize;
+    {L"zopfli", ZLIB_COMPRESSION, zlib_bound, zopfli_compress, zlib_options, true}, // 输出同样是zlib流
 #endif
-    if (compressed) {
+    {L"lz4", LZ4_COMPRESSION, lz4_compress_bound, lz4_compress, lz4_options, false},
+};
+
+const compressor* find_compressor(const wchar_t* name)
+{
+    for (size_t i = 0; i < sizeof(g_compressors) / sizeof(g_compressors[0]); i++) {
+        if (wcsicmp(g_compressors[i].name, name) == 0) {
+            return &g_compressors[i];
+        }
+    }
+    return NULL;
+}
+
+void end_compressctx(compressctx* ctx)
+{
+    for (int i = 0; i < ZATTEMPT_COUNT; i++) {
+        if (ctx->z.inited[i]) {
+            deflateEnd(&ctx->z.strm[i]);
+            ctx->z.inited[i] = false;
+        }
+    }
+    free(ctx->z.scratch);
+    ctx->z.scratch = NULL;
+    ctx->z.scratchsize = 0;
+    lz4hc_free(&ctx->lz4);
+}
+
+// adler: 调用方已增量算好的adler32, 为NULL则压缩时计算
+size_t compress_to_file(void* block, size_t blocksize, bool ismeta, const uint32_t* adler)
+{
+    void* zblock = malloc(g_compressor->bound(blocksize));
+    g_cmain.splitthreads = g_num_cores; // 碎片块串行压缩, 分块评估用满核心
+    g_cmain.adler = adler;
+    size_t zsize = g_compressor->compress(&g_cmain, block, blocksize, zblock);
+    if (zsize && zsize < blocksize) {
         if (ismeta) {
             _write(g_opkfd, &zsize, sizeof(uint16_t)); // little endian
         }
@@ -555,7 +863,7 @@ uint64_t compress_meta_blocks(void* buf, size_t len, bool withoffsets)
         if (withoffsets) {
             offsets[i] = g_block_offset;
         }
-        compress_to_file((char*)buf + i * MDB_SIZE, blocksize, true);
+        compress_to_file((char*)buf + i * MDB_SIZE, blocksize, true, NULL);
         len -= blocksize;
     }
     uint64_t offsetsoffset = g_block_offset;
@@ -566,46 +874,35 @@ uint64_t compress_meta_blocks(void* buf, size_t len, bool withoffsets)
     return offsetsoffset;
 }
 
-bytevec* pre_compress_meta_blocks(bytevec* src, uint32_t* offsets)
+// 把明文里已写满的metablock压缩追加到zdata, final时连同最后不满的一块
+// 调用方须保证flushed之后到当前写入位置之前的内容都已定稿(不再回填)
+void flush_meta_blocks(metatable* table, bool final)
 {
-    bytevec* dest = (bytevec*)calloc(1, sizeof(bytevec));
-    dest->align = MDB_SIZE;
-    int blockcnt = (src->size + MDB_SIZE - 1) / MDB_SIZE;
-    unsigned char* block = (unsigned char*)src->data;
-    int len = src->size;
-    for (int i = 0; i < blockcnt; i++, block += MDB_SIZE) {
-        size_t blocksize = len >= MDB_SIZE ? MDB_SIZE : len;
-        bool compressed;
-#ifdef USE_ZOPFLI
-        ZopfliOptions options;
-        ZopfliInitOptions(&options);
-        options.numiterations = 15;
-        unsigned char* zblock = NULL;
-        size_t zsize = 0;
-        offsets[i] = dest->size;
-        ZopfliZlibCompress(&options, block, blocksize, &zblock, &zsize);
-        compressed = zsize < blocksize;
-#else
-        uLong zsize = compressBound(blocksize);
-        void* zblock = malloc(zsize);
-        offsets[i] = dest->size;
-        int ret = compress2(zblock, &zsize, block, blocksize, Z_BEST_COMPRESSION);
-        compressed = ret == Z_OK && zsize < blocksize;
-#endif
-        if (compressed) {
-            *(uint16_t*)alloc_bytevec(dest, sizeof(uint16_t)) = (uint16_t)zsize; // little endian
-            append_bytevec(dest, zblock, zsize);
+    while (table->plain.size - table->flushed >= MDB_SIZE || (final && table->plain.size > table->flushed)) {
+        unsigned char* block = (unsigned char*)table->plain.data + table->flushed;
+        size_t blocksize = min(table->plain.size - table->flushed, MDB_SIZE);
+        void* zblock = malloc(g_compressor->bound(blocksize));
+        g_cmain.splitthreads = 1;
+        g_cmain.adler = NULL;
+        size_t zsize = g_compressor->compress(&g_cmain, block, blocksize, zblock);
+        if (zsize && zsize < blocksize) {
+            *(uint16_t*)alloc_bytevec(&table->zdata, sizeof(uint16_t)) = (uint16_t)zsize; // little endian
+            append_bytevec(&table->zdata, zblock, zsize);
         } else {
             // max 0x2000
-            *(uint16_t*)alloc_bytevec(dest, sizeof(uint16_t)) = (uint16_t)blocksize | 0x8000;
-            append_bytevec(dest, block, blocksize);
+            *(uint16_t*)alloc_bytevec(&table->zdata, sizeof(uint16_t)) = (uint16_t)blocksize | 0x8000;
+            append_bytevec(&table->zdata, block, blocksize);
         }
         free(zblock);
-
-        len -= blocksize;
+        table->flushed += blocksize;
     }
+}
 
-    return dest;
+// 当前写入位置的引用: 所在metablock压缩后的起始位置<<16 | 块内明文偏移
+// 须先flush_meta_blocks, 此时当前metablock之前的块都已压缩, 起始位置就是zdata的长度
+uint64_t metatable_ref(const metatable* table)
+{
+    return ((uint64_t)table->zdata.size << 16) | (table->plain.size % MDB_SIZE);
 }
 
 typedef struct compresstask
@@ -614,27 +911,51 @@ typedef struct compresstask
     size_t blocksize;
     void* zblock;
     size_t zsize;
+    bool sparse; // 全零块, 不写入, 块表里记0
+    bool hasadler; // adler已在读入时算好
+    uint32_t adler;
+    int splitthreads; // 分块评估线程数, 本批块数不足核心数时分给每块
+#ifdef USE_ZOPFLI
+    tierstat tiers[TIER_COUNT]; // 本任务的分级统计, 等待线程结束后由主线程汇总
+    ZopfliStatsPrior prior; // 热启动统计, 压完后是本块收敛的统计
+#endif
+    compressctx* ctx; // 本线程槽位复用的压缩上下文
 } compresstask;
 
+bool is_zero_block(const void* block, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)block;
+    for (; len && ((uintptr_t)p & 7); len--) {
+        if (*p++) return false;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        if (*(const uint64_t*)p) return false;
+    }
+    for (; len; len--) {
+        if (*p++) return false;
+    }
+    return true;
+}
+
 unsigned __stdcall compresstask_proc(void* arg)
 {
     compresstask* task = (compresstask*)arg;
-    bool compressed;
+    compressctx* ctx = task->ctx;
+    ctx->splitthreads = task->splitthreads;
+    ctx->adler = task->hasadler ? &task->adler : NULL;
 #ifdef USE_ZOPFLI
-    ZopfliOptions options;
-    ZopfliInitOptions(&options);
-    options.numiterations = 15;
-    unsigned char* zblock = NULL;
-    size_t zsize = 0;
-    ZopfliZlibCompress(&options, (unsigned char*)task->block, task->blocksize, &zblock, &zsize);
-    compressed = zsize < task->blocksize;
-#else
-    uLong zsize = compressBound(task->blocksize);
-    void* zblock = malloc(zsize);
-    int ret = compress2(zblock, &zsize, task->block, task->blocksize, Z_BEST_COMPRESSION);
-    compressed = ret == Z_OK && zsize < task->blocksize;
+    ctx->prior = g_warm_iterations ? &task->prior : NULL;
+    ctx->tiers = task->tiers;
 #endif
-    if (compressed) {
+    task->sparse = is_zero_block(task->block, task->blocksize);
+    if (task->sparse) {
+        task->zblock = NULL;
+        task->zsize = 0;
+        return 0;
+    }
+    void* zblock = malloc(g_compressor->bound(task->blocksize));
+    size_t zsize = g_compressor->compress(ctx, task->block, task->blocksize, zblock);
+    if (zsize && zsize < task->blocksize) {
         task->zblock = zblock;
         task->zsize = zsize;
     } else {
@@ -645,48 +966,282 @@ unsigned __stdcall compresstask_proc(void* arg)
     return 0;
 }
 
-uint16_t* pre_caculate_inode_offsets()
+// 放进碎片块的尾部长度, 没有则为0. notailends下只存size小于BLOCK_SIZE的
+size_t fragment_tail(const nodeitem* item)
 {
-    uint16_t* nodeoffsets = (uint16_t*)malloc(sizeof(uint16_t) * g_nodesize); // 给dir entry查表用
-    size_t nodevsize = 0;
-    for (int i = 0; i < g_nodesize; i++) {
-        nodeitem* item = &g_nodes[i];
-        switch (item->type) {
-        case SQUASHFS_REG_TYPE:
-            nodeoffsets[item->nodenum] = (uint16_t)nodevsize;
-            nodevsize += sizeof(struct squashfs_reg_inode) + (item->size / g_BLOCK_SIZE) * sizeof(uint32_t);
-            break;
-        case SQUASHFS_SYMLINK_TYPE:
-            nodeoffsets[item->nodenum] = (uint16_t)nodevsize;
-            nodevsize += sizeof(struct squashfs_symlink_inode) + (size_t)item->size;
-            break;
-        case SQUASHFS_DIR_TYPE:
-            verbose("set dir #%d offset to 0x%X\n", item->nodenum, nodevsize);
-            nodeoffsets[item->nodenum] = (uint16_t)nodevsize;
-            nodevsize += sizeof(struct squashfs_dir_inode);
-            break;
+    if (!g_tailends && item->size >= g_BLOCK_SIZE) {
+        return 0;
+    }
+    return (size_t)(item->size % g_BLOCK_SIZE);
+}
+
+typedef struct fragbin
+{
+    uint32_t size; // 规划时分到的尾块总长
+    uint32_t filled; // 已写入的长度, 等于size时压缩落盘
+    char* data; // 第一个尾块到达时分配, 落盘后释放
+#ifdef USE_ZOPFLI
+    uint32_t adler; // 尾块追加时增量计算, 压缩时不用再扫一遍
+#endif
+} fragbin;
+
+// 尾块的内容特征, 相似的尾块放进同一碎片块, deflate窗口内重复更多, 设备端缓存的碎片块也更可能被连带用到
+typedef struct fragfeature
+{
+    uint32_t ext; // 小写扩展名的hash, 没有为0
+    uint32_t hist[16]; // 字节高4位的直方图
+    uint32_t minhash[FRAGMENT_MINHASH]; // 4字节shingle的MinHash
+    bool hashed; // 有过shingle; 不足4字节或打不开的尾块minhash全是初值, 不能拿来比
+} fragfeature;
+
+uint32_t extension_hash(const wchar_t* path)
+{
+    const wchar_t* ext = NULL;
+    for (const wchar_t* p = path; *p; p++) {
+        if (*p == L'.') {
+            ext = p + 1;
+        } else if (*p == L'\\' || *p == L'/') {
+            ext = NULL;
+        }
+    }
+    if (!ext || !*ext) {
+        return 0;
+    }
+    uint32_t h = 2166136261u; // FNV-1a
+    for (; *ext; ext++) {
+        wchar_t c = (*ext >= L'A' && *ext <= L'Z') ? *ext + (L'a' - L'A') : *ext;
+        h = (h ^ (uint32_t)c) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+// 只读尾块开头FRAGMENT_SAMPLE字节, 打不开的文件只有扩展名特征
+// 规划在写数据之前, 每个有尾块的文件因此要多打开读一次; -no-fraggroup时不读
+void get_fragment_feature(const nodeitem* item, size_t tail, fragfeature* feature)
+{
+    memset(feature, 0, sizeof(fragfeature));
+    memset(feature->minhash, 0xFF, sizeof(feature->minhash));
+    feature->ext = extension_hash(item->path);
+#ifdef _INC_CRTDEFS
+    int fd = _wopen(item->path, O_RDONLY | O_BINARY, 0); // WDK
+#else
+    int fd = _wopen(item->path, O_RDONLY | O_BINARY); // posix
+#endif
+    if (fd == -1) {
+        return;
+    }
+    unsigned char sample[FRAGMENT_SAMPLE];
+    _lseeki64(fd, item->size - tail, SEEK_SET);
+    int len = _read(fd, sample, (unsigned)min(tail, FRAGMENT_SAMPLE));
+    _close(fd);
+    for (int j = 0; j < len; j++) {
+        feature->hist[sample[j] >> 4]++;
+    }
+    feature->hashed = len >= 4;
+    for (int j = 0; j + 4 <= len; j++) {
+        uint32_t shingle = sample[j] | (sample[j + 1] << 8) | (sample[j + 2] << 16) | ((uint32_t)sample[j + 3] << 24);
+        for (int k = 0; k < FRAGMENT_MINHASH; k++) {
+            uint32_t h = mix32(shingle ^ (0x9E3779B9u * (k + 1))); // 每个k一个独立的hash
+            if (h < feature->minhash[k]) {
+                feature->minhash[k] = h;
+            }
         }
     }
-    return nodeoffsets;
+}
+
+// 尾块放进碎片块后并入块的特征: MinHash逐项取小即并集的MinHash, 直方图相加, 扩展名不同则清掉
+void merge_fragment_feature(fragfeature* bin, const fragfeature* tail)
+{
+    bin->hashed = bin->hashed || tail->hashed; // 空的MinHash逐项取小不改变另一方
+    for (int k = 0; k < FRAGMENT_MINHASH; k++) {
+        if (tail->minhash[k] < bin->minhash[k]) {
+            bin->minhash[k] = tail->minhash[k];
+        }
+    }
+    for (int j = 0; j < 16; j++) {
+        bin->hist[j] += tail->hist[j];
+    }
+    if (bin->ext != tail->ext) {
+        bin->ext = 0;
+    }
+}
+
+// 0~100: MinHash估计的shingle Jaccard占40(任一方MinHash为空时不计), 直方图重合度占30, 扩展名相同占30
+int fragment_similarity(const fragfeature* a, const fragfeature* b)
+{
+    int same = 0;
+    for (int k = 0; a->hashed && b->hashed && k < FRAGMENT_MINHASH; k++) {
+        same += a->minhash[k] == b->minhash[k];
+    }
+    uint64_t ta = 0, tb = 0;
+    for (int j = 0; j < 16; j++) {
+        ta += a->hist[j];
+        tb += b->hist[j];
+    }
+    double overlap = 0; // 两个归一化直方图逐项取小之和, 1为完全相同
+    if (ta && tb) {
+        for (int j = 0; j < 16; j++) {
+            overlap += min((double)a->hist[j] / ta, (double)b->hist[j] / tb);
+        }
+    }
+    return same * 40 / FRAGMENT_MINHASH + (int)(overlap * 30) + (a->ext && a->ext == b->ext ? 30 : 0);
+}
+
+int compare_tail_desc(const void* a, const void* b)
+{
+    uint32_t ia = *(const uint32_t*)a;
+    uint32_t ib = *(const uint32_t*)b;
+    size_t ta = fragment_tail(&g_nodes[ia]);
+    size_t tb = fragment_tail(&g_nodes[ib]);
+    if (ta != tb) {
+        return ta > tb ? -1 : 1;
+    }
+    return ia < ib ? -1 : (ia > ib); // 同样大小保持inode顺序, 结果可复现
+}
+
+// 碎片装箱规划, 在写数据之前用扫描时得到的文件大小完成:
+// 按inode顺序每次取FRAGMENT_LOOKAHEAD个尾块, 从大到小放进放得下的未满碎片块, 都放不下才开新块;
+// 默认选剩余空间最小的(best fit). g_fraggroup时放得下的块中有相似度达到FRAGMENT_SIMILAR的, 选最相似的;
+// 都不够相似时, 只有已开的块数还少于尾块总长所需的最少块数才为它另开一块(块的特征随放入的尾块合并),
+// 块数因此不会因分组而增加, 未满的块也只剩最后几个. 未满的块超过FRAGMENT_OPEN_BINS个时关掉最满的.
+// 尾块不会跨碎片块, 写盘时同时缓存的碎片块也有上限
+// fragof[i]为g_nodes[i]分到的碎片块号, 没有尾块为-1
+fragbin* plan_fragments(uint32_t* fragof, uint32_t* bincount)
+{
+    bytevec bins = {NULL, 64 * sizeof(fragbin)};
+    bytevec binfeatures = {NULL, 64 * sizeof(fragfeature)}; // 每个碎片块的代表特征
+    uint32_t window[FRAGMENT_LOOKAHEAD]; // g_nodes下标
+    fragfeature features[FRAGMENT_LOOKAHEAD]; // 与window对应
+    uint32_t open[FRAGMENT_OPEN_BINS + FRAGMENT_LOOKAHEAD]; // 未满的碎片块号
+    uint32_t opencnt = 0;
+    uint64_t tailbytes = 0;
+    for (int n = 0; n < g_nodesize; n++) {
+        if (g_nodes[n].type == SQUASHFS_REG_TYPE) {
+            tailbytes += fragment_tail(&g_nodes[n]);
+        }
+    }
+    uint64_t minbins = (tailbytes + g_BLOCK_SIZE - 1) / g_BLOCK_SIZE; // 尾块总长所需的最少碎片块数
+    int i = 0;
+    while (i < g_nodesize) {
+        uint32_t cnt = 0;
+        for (; i < g_nodesize && cnt < FRAGMENT_LOOKAHEAD; i++) {
+            fragof[i] = -1;
+            if (g_nodes[i].type == SQUASHFS_REG_TYPE && fragment_tail(&g_nodes[i])) {
+                window[cnt++] = i;
+            }
+        }
+        qsort(window, cnt, sizeof(uint32_t), compare_tail_desc);
+        if (g_fraggroup) {
+            for (uint32_t k = 0; k < cnt; k++) {
+                get_fragment_feature(&g_nodes[window[k]], fragment_tail(&g_nodes[window[k]]), &features[k]);
+            }
+        }
+        for (uint32_t k = 0; k < cnt; k++) {
+            size_t tail = fragment_tail(&g_nodes[window[k]]);
+            uint32_t fit = opencnt; // 剩余空间最小的
+            uint32_t similar = opencnt; // 够相似的块中最相似的
+            size_t fitroom = 0;
+            int bestscore = FRAGMENT_SIMILAR - 1;
+            for (uint32_t o = 0; o < opencnt; o++) {
+                size_t room = g_BLOCK_SIZE - ((fragbin*)bins.data)[open[o]].size;
+                if (room < tail) {
+                    continue;
+                }
+                if (fit == opencnt || room < fitroom) {
+                    fit = o;
+                    fitroom = room;
+                }
+                int score = g_fraggroup ? fragment_similarity(&features[k], (fragfeature*)binfeatures.data + open[o]) : 0;
+                if (score > bestscore) {
+                    similar = o;
+                    bestscore = score;
+                }
+            }
+            uint32_t best = similar != opencnt ? similar : fit;
+            if (best == opencnt || (similar == opencnt && g_fraggroup && bins.size / sizeof(fragbin) < minbins && opencnt < FRAGMENT_OPEN_BINS)) {
+                alloc_bytevec(&bins, sizeof(fragbin));
+                fragfeature* feature = (fragfeature*)alloc_bytevec(&binfeatures, sizeof(fragfeature));
+                if (g_fraggroup) {
+                    *feature = features[k];
+                }
+                best = opencnt;
+                open[opencnt++] = bins.size / sizeof(fragbin) - 1;
+            } else if (g_fraggroup) {
+                merge_fragment_feature((fragfeature*)binfeatures.data + open[best], &features[k]);
+            }
+            ((fragbin*)bins.data)[open[best]].size += (uint32_t)tail;
+            fragof[window[k]] = open[best];
+        }
+        // 装满的和超出上限时最满的不再接收尾块
+        for (uint32_t o = 0; o < opencnt; ) {
+            if (((fragbin*)bins.data)[open[o]].size == g_BLOCK_SIZE) {
+                open[o] = open[--opencnt];
+            } else {
+                o++;
+            }
+        }
+        while (opencnt > FRAGMENT_OPEN_BINS) {
+            uint32_t fullest = 0;
+            for (uint32_t o = 1; o < opencnt; o++) {
+                if (((fragbin*)bins.data)[open[o]].size > ((fragbin*)bins.data)[open[fullest]].size) {
+                    fullest = o;
+                }
+            }
+            open[fullest] = open[--opencnt];
+        }
+    }
+    free(binfeatures.data);
+    *bincount = bins.size / sizeof(fragbin);
+    return (fragbin*)bins.data;
+}
+
+// 碎片块压缩写盘, 压不小的原样存, size带上未压缩标志
+void write_fragment(fragbin* bin, struct squashfs_fragment_entry* entry)
+{
+    verbose("  fragment at 0x%I64X, %u bytes\n", g_block_offset, bin->filled);
+    entry->start_block = g_block_offset;
+#ifdef USE_ZOPFLI
+    size_t zsize = compress_to_file(bin->data, bin->filled, false, &bin->adler);
+#else
+    size_t zsize = compress_to_file(bin->data, bin->filled, false, NULL);
+#endif
+    entry->size = zsize < bin->filled ? zsize : (bin->filled | (1 << 24));
+    free(bin->data);
+    bin->data = NULL;
 }
 
 void save_data_blocks()
 {
-    bytevec fragblocks = {NULL, g_BLOCK_SIZE};
-    bytevec inodetable = {NULL, MDB_SIZE};
-    bytevec dirtable = {NULL, MDB_SIZE};
-    bytevec fixuptable = {NULL, 64};
-    typedef struct fixpair {
-        uint32_t index;
-        uint32_t* pstart_block;
-    } fixpair;
+    // 两个表都边生成边压缩: inode按倒置树顺序先子后父生成, 引用子inode/目录列表时其metablock起始已知, 不用事后回填
+    metatable inodetable = {{NULL, MDB_SIZE}, {NULL, MDB_SIZE}, 0};
+    metatable dirtable = {{NULL, MDB_SIZE}, {NULL, MDB_SIZE}, 0};
     SYSTEM_INFO sysInfo;
     GetSystemInfo(&sysInfo);
     uint32_t num_cores = sysInfo.dwNumberOfProcessors;
-    //uint16_t* nodeoffsets = pre_caculate_inode_offsets(); // 给dir entry查表用 (非倒置树将无法运行中排序)
-    uint16_t* nodeoffsets = (uint16_t*)malloc(sizeof(uint16_t) * g_nodesize); // 给dir entry查表用(倒置树, 运行中排序)
+    g_num_cores = num_cores;
+    uint64_t* noderefs = (uint64_t*)malloc(sizeof(uint64_t) * (g_nodesize + 1)); // 按inode号(从1开始)索引, inode引用(压缩后metablock<<16|偏移), 给dir entry查表用(倒置树, 运行中排序)
+    compressctx* cctx = (compressctx*)calloc(num_cores, sizeof(compressctx)); // 第k个任务槽位固定用cctx[k], 跨文件复用
+    // 先规划好每个尾块进哪个碎片块, 碎片块收齐即压缩写盘
+    uint32_t* fragof = (uint32_t*)malloc(sizeof(uint32_t) * (g_nodesize + 1));
+    uint32_t fragcnt = 0;
+    fragbin* fragbins = plan_fragments(fragof, &fragcnt);
+    struct squashfs_fragment_entry* fragtable = (struct squashfs_fragment_entry*)calloc(fragcnt + 1, sizeof(struct squashfs_fragment_entry));
+    if (fragcnt) {
+        printf("Packing tails into %u fragments\n", fragcnt);
+    }
     for (int i = 0; i < g_nodesize; i++) {
         nodeitem* item = &g_nodes[i];
+        flush_meta_blocks(&inodetable, false); // 之前的inode都已定稿
         if (item->type == SQUASHFS_REG_TYPE) {
 #ifdef _INC_CRTDEFS
             int fd = _wopen(item->path, O_RDONLY | O_BINARY, 0); // WDK
@@ -702,38 +1257,67 @@ void save_data_blocks()
             if (blockcnt && !g_tailends && item->size % g_BLOCK_SIZE) {
                 blockcnt++;
             }
-            nodeoffsets[item->nodenum] = (uint16_t)inodetable.size;
-            //verbose("set file #%d offset to 0x%X\n", item->nodenum, inodetable.size);
-            struct squashfs_reg_inode* inode = (struct squashfs_reg_inode*)alloc_bytevec(&inodetable, sizeof(struct squashfs_reg_inode) + blockcnt * sizeof(uint32_t));
-            inode->header.inode_type = SQUASHFS_REG_TYPE;
-            inode->header.inode_number = item->nodenum;
-            inode->header.mtime = item->mtime;
-            inode->start_block = blockcnt?g_block_offset:0; // 写入当前文件之前的ftell
-            inode->file_size = item->size; // 大于4G要用lreg
-            // TODO: 多线程压缩, 顺序写入(WaitMultipleObject)
+            // 块表, 压缩完才知道是否有稀疏块, 据此再决定用reg还是lreg inode
+            uint32_t* blocklist = (uint32_t*)calloc(blockcnt ? blockcnt : 1, sizeof(uint32_t));
+            uint64_t start_block = blockcnt ? g_block_offset : 0; // 写入当前文件之前的ftell
+            uint64_t sparsebytes = 0;
+            uint16_t mode = 0;
             if (blockcnt) {
                 compresstask* tasks = (compresstask*)malloc(sizeof(compresstask)*num_cores);
                 HANDLE* threads = (HANDLE*)malloc(sizeof(HANDLE)*num_cores);
                 char* blocks = (char*)malloc(g_BLOCK_SIZE * num_cores);
                 wprintf(L"Compressing %s", item->path);
                 printf(", %u block\n", blockcnt);
-                size_t leftsize = item->size;
+                uint64_t leftsize = item->size;
+#ifdef USE_ZOPFLI
+                // 同一批的块并行压缩, 都从上一批最后一块的统计热启动, 第一批冷启动
+                ZopfliStatsPrior fileprior;
+                memset(&fileprior, 0, sizeof(fileprior));
+#endif
                 for (size_t j = 0; j < blockcnt; j += num_cores) {
                     size_t runcnt = min(num_cores, blockcnt - j);
                     _read(fd, blocks, g_BLOCK_SIZE * runcnt);
                     if (g_autoexec && j == 0 && leftsize >=4 && *(uint32_t*)blocks == ELF_MAGIC) {
-                        inode->header.mode = 0500;
+                        mode = 0500;
                     }
                     for (size_t k = 0; k < runcnt; k++, leftsize -= g_BLOCK_SIZE) {
                         tasks[k].block = blocks + k * g_BLOCK_SIZE;
-                        tasks[k].blocksize = min(g_BLOCK_SIZE, leftsize);
+                        tasks[k].blocksize = (size_t)min(g_BLOCK_SIZE, leftsize);
+                        tasks[k].hasadler = false;
+#ifdef USE_ZOPFLI
+                        // 块刚读入还在缓存里, 顺便算好adler32, 压缩线程不用再扫一遍
+                        if (g_compressor->needadler) {
+                            tasks[k].adler = ZopfliUpdateAdler32(ZOPFLI_ADLER32_INIT, (const unsigned char*)tasks[k].block, tasks[k].blocksize);
+                            tasks[k].hasadler = true;
+                        }
+#endif
+                        tasks[k].splitthreads = num_cores / runcnt;
+#ifdef USE_ZOPFLI
+                        memset(tasks[k].tiers, 0, sizeof(tasks[k].tiers));
+                        tasks[k].prior = fileprior;
+#endif
+                        tasks[k].ctx = &cctx[k];
                         threads[k] = (HANDLE)_beginthreadex(NULL, 0, compresstask_proc, &tasks[k], 0, NULL);
                     }
                     //WaitForMultipleObjects(runcnt, threads, TRUE, INFINITE);
                     for (size_t k = 0; k < runcnt; k++) {
                         WaitForSingleObject(threads[k], INFINITE);
                         CloseHandle(threads[k]);
-                        verbose("  [%u] at 0x%X, ", k, g_block_offset);
+#ifdef USE_ZOPFLI
+                        for (int t = 0; t < TIER_COUNT; t++) {
+                            g_tiers[t].blocks += tasks[k].tiers[t].blocks;
+                            g_tiers[t].rawbytes += tasks[k].tiers[t].rawbytes;
+                            g_tiers[t].zbytes += tasks[k].tiers[t].zbytes;
+                            g_tiers[t].seconds += tasks[k].tiers[t].seconds;
+                        }
+#endif
+                        if (tasks[k].sparse) {
+                            verbose("  [%u] sparse\n", k);
+                            sparsebytes += tasks[k].blocksize;
+                            blocklist[j + k] = 0;
+                            continue;
+                        }
+                        verbose("  [%u] at 0x%I64X, ", k, g_block_offset);
                         if (tasks[k].zblock) {
                             g_block_offset += _write(g_opkfd, tasks[k].zblock, tasks[k].zsize);
                             free(tasks[k].zblock);
@@ -741,34 +1325,76 @@ void save_data_blocks()
                             g_block_offset += _write(g_opkfd, tasks[k].block, tasks[k].blocksize);
                         }
                         verbose("size 0x%X\n", tasks[k].zblock ? tasks[k].zsize : tasks[k].blocksize);
-                        inode->blocks[j + k] = tasks[k].zblock ? tasks[k].zsize : (tasks[k].blocksize | (1 << 24));
+                        blocklist[j + k] = tasks[k].zblock ? tasks[k].zsize : (tasks[k].blocksize | (1 << 24));
                     }
+#ifdef USE_ZOPFLI
+                    fileprior = tasks[runcnt - 1].prior;
+#endif
                 }
                 free(blocks);
                 free(threads);
                 free(tasks);
             }
-            // notailends下只存size小于BLOCK_SIZE的
-            size_t fragtail = item->size % g_BLOCK_SIZE;
-            if (fragtail && (g_tailends || (!g_tailends && item->size < g_BLOCK_SIZE))) {
+            uint32_t fragment = -1;
+            uint32_t fragoffset = 0;
+            size_t fragtail = fragment_tail(item);
+            if (fragtail) {
+                fragment = fragof[i];
+                fragbin* bin = &fragbins[fragment];
                 wprintf(L"Append %s, %u", item->path, fragtail);
-                printf(" bytes to fragments.\n");
-                void* block = malloc(g_BLOCK_SIZE);
-                _read(fd, block, fragtail);
-                inode->fragment = fragblocks.size / g_BLOCK_SIZE;
-                inode->offset = fragblocks.size % g_BLOCK_SIZE;
-                append_bytevec(&fragblocks, block, fragtail);
-                free(block);
+                printf(" bytes to fragment %u.\n", fragment);
+                if (!bin->data) {
+                    bin->data = (char*)malloc(g_BLOCK_SIZE);
+#ifdef USE_ZOPFLI
+                    bin->adler = ZOPFLI_ADLER32_INIT;
+#endif
+                }
+                fragoffset = bin->filled;
+                _read(fd, bin->data + fragoffset, fragtail);
+#ifdef USE_ZOPFLI
+                bin->adler = ZopfliUpdateAdler32(bin->adler, (const unsigned char*)bin->data + fragoffset, fragtail);
+#endif
+                bin->filled += (uint32_t)fragtail;
+                if (bin->filled == bin->size) {
+                    write_fragment(bin, &fragtable[fragment]);
+                }
+            }
+            // 文件或其起始位置超出32位, 或有稀疏块时用lreg
+            noderefs[item->nodenum] = metatable_ref(&inodetable);
+            //verbose("set file #%d offset to 0x%X\n", item->nodenum, inodetable.plain.size);
+            if (item->size > UINT32_MAX || start_block > UINT32_MAX || sparsebytes) {
+                struct squashfs_lreg_inode* inode = (struct squashfs_lreg_inode*)alloc_bytevec(&inodetable.plain, sizeof(struct squashfs_lreg_inode) + blockcnt * sizeof(uint32_t));
+                inode->header.inode_type = SQUASHFS_LREG_TYPE;
+                inode->header.inode_number = item->nodenum;
+                inode->header.mode = mode;
+                inode->header.mtime = item->mtime;
+                inode->start_block = start_block;
+                inode->file_size = item->size;
+                inode->sparse = sparsebytes;
+                inode->nlink = 1; // 扫描时不识别硬链接, 每个路径一个inode
+                inode->fragment = fragment;
+                inode->offset = fragoffset;
+                inode->xattr = SQUASHFS_INVALID_XATTR;
+                memcpy(inode->blocks, blocklist, blockcnt * sizeof(uint32_t));
             } else {
-                inode->fragment = -1;
-                //inode->offset = 0;
+                struct squashfs_reg_inode* inode = (struct squashfs_reg_inode*)alloc_bytevec(&inodetable.plain, sizeof(struct squashfs_reg_inode) + blockcnt * sizeof(uint32_t));
+                inode->header.inode_type = SQUASHFS_REG_TYPE;
+                inode->header.inode_number = item->nodenum;
+                inode->header.mode = mode;
+                inode->header.mtime = item->mtime;
+                inode->start_block = (uint32_t)start_block;
+                inode->file_size = (uint32_t)item->size;
+                inode->fragment = fragment;
+                inode->offset = fragoffset;
+                memcpy(inode->blocks, blocklist, blockcnt * sizeof(uint32_t));
             }
+            free(blocklist);
             _close(fd);
         }
         if (item->type == SQUASHFS_SYMLINK_TYPE) {
-            nodeoffsets[item->nodenum] = (uint16_t)inodetable.size;
+            noderefs[item->nodenum] = metatable_ref(&inodetable);
             size_t linklen = (size_t)item->size; // utf8 count
-            struct squashfs_symlink_inode* inode = (struct squashfs_symlink_inode*)alloc_bytevec(&inodetable, sizeof(struct squashfs_symlink_inode) + linklen);
+            struct squashfs_symlink_inode* inode = (struct squashfs_symlink_inode*)alloc_bytevec(&inodetable.plain, sizeof(struct squashfs_symlink_inode) + linklen);
             inode->header.inode_type = SQUASHFS_SYMLINK_TYPE;
             inode->header.inode_number = item->nodenum;
             inode->header.mtime = item->mtime;
@@ -777,102 +1403,136 @@ void save_data_blocks()
         }
         // 根目录node的偏移写入superblock
         if (item->nodenum == g_root_inode) {
-            sb.root_inode = inodetable.size;
+            sb.root_inode = metatable_ref(&inodetable);
         }
         if (item->type == SQUASHFS_DIR_TYPE) {
-            size_t metablockpos = inodetable.size;
-            //verbose("set dir #%d offset to 0x%X\n", item->nodenum, inodetable.size);
-            nodeoffsets[item->nodenum] = (uint16_t)inodetable.size;
-            struct squashfs_dir_inode* inode = (struct squashfs_dir_inode*)alloc_bytevec(&inodetable, sizeof(struct squashfs_dir_inode));
-            inode->header.inode_type = SQUASHFS_DIR_TYPE;
-            inode->header.inode_number = item->nodenum;
-            inode->header.mtime = item->mtime;
-            if (item->paths->count) {
-                inode->file_size = sizeof(struct squashfs_dir_header) + sizeof(struct squashfs_dir_entry) * item->paths->count + (item->paths->size - item->paths->count) + 3;
-            } else {
-                inode->file_size = 3; // 不生成squashfs_dir_header
-            }
-            inode->nlink = 2; // historical . ..
-            inode->parent_inode = item->parentnodenum;
-            // 仅为非空目录生成目录内容列表(header+entries)
-            // 依赖于nodeoffsets排序已完成, 如未做倒金字塔排序, 需要预先完整遍历
+            //verbose("set dir #%d offset to 0x%X\n", item->nodenum, inodetable.plain.size);
+            // 先生成目录内容列表(header+entries), 仅非空目录才有
+            // 依赖于noderefs排序已完成, 如未做倒金字塔排序, 需要预先完整遍历
+            flush_meta_blocks(&dirtable, false);
+            size_t dirstart = dirtable.plain.size;
+            uint64_t dirref = metatable_ref(&dirtable);
+            bytevec dirindexes = {NULL, 256}; // 列表跨metablock时, 每个metablock第一个header的索引(squashfs_dir_index+名字)
+            uint32_t indexcount = 0;
             if (item->paths->count) {
-                //inode->start_block = (dirtable.size / MDB_SIZE) * MDB_SIZE; // 需要是dir header所在metablock压缩后偏移
-                fixpair* fix = (fixpair*)alloc_bytevec(&fixuptable, sizeof(fixpair));
-                fix->index = dirtable.size / MDB_SIZE;
-                fix->pstart_block = &inode->start_block;
-                inode->offset = dirtable.size % MDB_SIZE;
-                // prepare directory header and entries
-                struct squashfs_dir_header* header = (struct squashfs_dir_header*)alloc_bytevec(&dirtable, sizeof(struct squashfs_dir_header));
-                uint32_t startnode = item->childs[0].node;
-                header->count = item->paths->count - 1; // TODO: 每个header最多256记录, 多了要拆多个header
-                header->inode_number = startnode; // 并非目录inode
-                header->start_block = (metablockpos / MDB_SIZE) * MDB_SIZE; // 明文偏移, 不需压缩后回写?
+                // 一个header下的entry共用header的inode号基准和inode所在metablock, 所以遇到以下情况要另起header:
+                // 已满256个, inode号差值超出int16, 或者inode落在另一个metablock
+                // 另外列表写到dirtable新的metablock时也另起header, 并为它建索引, 查找时可直接跳到该metablock解压
+                size_t headerpos = 0; // 当前header在dirtable里的位置, alloc_bytevec会realloc, 不能存指针
+                size_t indexblock = dirstart / MDB_SIZE; // 最后一个索引(或列表开头)所在的dirtable metablock
+                uint32_t headercount = 0; // 当前header下已有的entry数
+                uint32_t startnode = 0;
+                uint32_t startblock = 0;
                 // TODO: 按原生顺序扫描和存储, 目录表才sort
-                for (size_t j = 0; j <= header->count; j++) {
+                for (int j = 0; j < item->paths->count; j++) {
+                    uint32_t node = item->childs[j].node;
+                    uint32_t nodeblock = (uint32_t)(noderefs[node] >> 16);
+                    int32_t delta = (int32_t)(node - startnode);
                     const char* filename = &item->paths->data[item->paths->indexes[j]];
                     size_t namelen = strlen(filename);
-                    struct squashfs_dir_entry* entry = (struct squashfs_dir_entry*)alloc_bytevec(&dirtable, sizeof(struct squashfs_dir_entry) + namelen);
+                    if (headercount == 0 || headercount == SQUASHFS_DIR_COUNT || nodeblock != startblock || delta < INT16_MIN || delta > INT16_MAX
+                        || dirtable.plain.size / MDB_SIZE != indexblock) {
+                        flush_meta_blocks(&dirtable, false); // 之前的header都已定稿
+                        headerpos = dirtable.plain.size;
+                        if (headerpos / MDB_SIZE != indexblock) {
+                            indexblock = headerpos / MDB_SIZE;
+                            struct squashfs_dir_index* index = (struct squashfs_dir_index*)alloc_bytevec(&dirindexes, sizeof(struct squashfs_dir_index) + namelen);
+                            index->index = (uint32_t)(headerpos - dirstart);
+                            index->start_block = (uint32_t)(metatable_ref(&dirtable) >> 16);
+                            index->size = namelen - 1;
+                            memcpy(index->name, filename, namelen); // header第一个entry的名字
+                            indexcount++;
+                        }
+                        struct squashfs_dir_header* header = (struct squashfs_dir_header*)alloc_bytevec(&dirtable.plain, sizeof(struct squashfs_dir_header));
+                        header->inode_number = node; // 并非目录inode
+                        header->start_block = nodeblock; // 子inode所在metablock压缩后的位置
+                        headercount = 0;
+                        startnode = node;
+                        startblock = nodeblock;
+                        delta = 0;
+                    }
+                    ((struct squashfs_dir_header*)((char*)dirtable.plain.data + headerpos))->count = headercount++; // 存的是个数减1
+                    struct squashfs_dir_entry* entry = (struct squashfs_dir_entry*)alloc_bytevec(&dirtable.plain, sizeof(struct squashfs_dir_entry) + namelen);
                     memcpy(entry->name, filename, namelen); // utf8
                     entry->type = item->childs[j].type;
                     entry->size = namelen - 1;
-                    entry->inode_number = item->childs[j].node - startnode; // node差值不能超过+-32768, 超过要拆header
-                    //verbose("node \"%s\" #%d offset 0x%X\n", filename, item->childs[j].node, nodeoffsets[item->childs[j].node]);
-                    entry->offset = nodeoffsets[item->childs[j].node]; // 对应的node加入时的inodevec.size, 能在accept directory时候放在g_nodes里吗
+                    entry->inode_number = (int16_t)delta;
+                    //verbose("node \"%s\" #%d ref 0x%llX\n", filename, node, noderefs[node]);
+                    entry->offset = (uint16_t)noderefs[node]; // 在header指定的metablock明文里的偏移
                 }
             }
+            // 空目录不生成squashfs_dir_header, file_size为3(. ..), 非空的再加上列表长度
+            size_t listsize = dirtable.plain.size - dirstart;
+            noderefs[item->nodenum] = metatable_ref(&inodetable);
+            if (indexcount || listsize + 3 > 0xFFFF) {
+                // 列表跨metablock或超过dir inode的16位file_size, 用带索引的ldir
+                struct squashfs_ldir_inode* inode = (struct squashfs_ldir_inode*)alloc_bytevec(&inodetable.plain, sizeof(struct squashfs_ldir_inode) + dirindexes.size);
+                inode->header.inode_type = SQUASHFS_LDIR_TYPE;
+                inode->header.inode_number = item->nodenum;
+                inode->header.mtime = item->mtime;
+                inode->nlink = 2; // historical . ..
+                inode->file_size = (uint32_t)(listsize + 3);
+                inode->parent_inode = item->parentnodenum;
+                inode->start_block = (uint32_t)(dirref >> 16);
+                inode->i_count = (uint16_t)indexcount;
+                inode->offset = (uint16_t)dirref;
+                inode->xattr = SQUASHFS_INVALID_XATTR;
+                memcpy(inode->index, dirindexes.data, dirindexes.size);
+            } else {
+                struct squashfs_dir_inode* inode = (struct squashfs_dir_inode*)alloc_bytevec(&inodetable.plain, sizeof(struct squashfs_dir_inode));
+                inode->header.inode_type = SQUASHFS_DIR_TYPE;
+                inode->header.inode_number = item->nodenum;
+                inode->header.mtime = item->mtime;
+                inode->file_size = (uint16_t)(listsize + 3);
+                inode->nlink = 2; // historical . ..
+                inode->parent_inode = item->parentnodenum;
+                inode->start_block = (uint32_t)(dirref >> 16);
+                inode->offset = (uint16_t)dirref;
+            }
+            free(dirindexes.data);
+        }
+    }
+    free(noderefs);
+    for (uint32_t k = 0; k < num_cores; k++) {
+        end_compressctx(&cctx[k]);
+    }
+    free(cctx);
+    // 有文件读取失败时, 它的碎片块收不齐, 按已收到的写盘
+    for (uint32_t j = 0; j < fragcnt; j++) {
+        if (fragbins[j].data) {
+            write_fragment(&fragbins[j], &fragtable[j]);
+        } else if (!fragbins[j].filled) {
+            fragtable[j].start_block = g_block_offset;
+            fragtable[j].size = 1 << 24;
         }
     }
-    free(nodeoffsets);
-    // 将囤积的碎片写入磁盘
-    // TODO: 跟压缩datablock逻辑合并
-    size_t fragsize = fragblocks.size;
-    size_t fragcnt = (fragblocks.size + g_BLOCK_SIZE - 1) / g_BLOCK_SIZE;
-    bytevec fragtable = { NULL, MDB_SIZE };
-    if (fragsize) {
-        printf("Compressing %d fragments\n", fragcnt);
-        for (size_t j = 0; j < fragcnt; j++) {
-            verbose("  [%u] at 0x%X\n", j, g_block_offset);
-            struct squashfs_fragment_entry* entry = (struct squashfs_fragment_entry*)alloc_bytevec(&fragtable, sizeof(struct squashfs_fragment_entry));
-            size_t blocksize = fragsize >=g_BLOCK_SIZE?g_BLOCK_SIZE:fragsize;
-            entry->start_block = g_block_offset;
-            entry->size = compress_to_file((char*)fragblocks.data + j * g_BLOCK_SIZE, blocksize, false);
-            fragsize -= blocksize;
-        }
-        free(fragblocks.data);
-    }
-    // 预压缩directory table, 再更新dir inode的start_block
-    uint32_t* zdirtablestarts = (uint32_t*)malloc(sizeof(uint32_t)*(dirtable.size + MDB_SIZE - 1)/MDB_SIZE);
-    bytevec* zdirtable = pre_compress_meta_blocks(&dirtable, zdirtablestarts);
-    free(dirtable.data); // dirtable用不到了
-    fixpair* fix = (fixpair*)fixuptable.data;
-    for (int i = fixuptable.size / sizeof(fixpair); i > 0; i--) {
-        *fix->pstart_block = zdirtablestarts[fix->index]; // 将压缩后block头部位置回写
-    }
-    free(zdirtablestarts);
-    free(fixuptable.data);
+    free(fragbins);
+    free(fragof);
     // save node table
     sb.inodes = g_nodesize;
     sb.inode_table_start = g_block_offset;
-    compress_meta_blocks(inodetable.data, inodetable.size, false);
-    free(inodetable.data);
+    flush_meta_blocks(&inodetable, true);
+    g_block_offset += _write(g_opkfd, inodetable.zdata.data, inodetable.zdata.size);
+    free(inodetable.plain.data);
+    free(inodetable.zdata.data);
     // save directory table
     sb.directory_table_start = g_block_offset;
-    g_block_offset += _write(g_opkfd, zdirtable->data, zdirtable->size);
-    free(zdirtable->data);
-    free(zdirtable);
+    flush_meta_blocks(&dirtable, true);
+    g_block_offset += _write(g_opkfd, dirtable.zdata.data, dirtable.zdata.size);
+    free(dirtable.plain.data);
+    free(dirtable.zdata.data);
     // save fragment table
-    if (fragtable.data) {
-        sb.fragments = fragcnt;
-        sb.fragment_table_start = compress_meta_blocks(fragtable.data, fragtable.size, true);
-        free(fragtable.data);
+    sb.fragments = fragcnt; // 没有碎片时为0, 内核跳过碎片表
+    if (fragcnt) {
+        sb.fragment_table_start = compress_meta_blocks(fragtable, fragcnt * sizeof(struct squashfs_fragment_entry), true);
     } else {
-        sb.fragments = -1;
-        //sb.fragment_table_start = 0;
+        sb.fragment_table_start = -1;
     }
+    free(fragtable);
     // save dummy IDs table
     uint32_t ID = 0;
     sb.id_table_start = compress_meta_blocks(&ID, sizeof(ID), true);
+    end_compressctx(&g_cmain);
 }
 
 char* unicode_to_utf8(const wchar_t* source)
@@ -37,6 +37,8 @@
 #define SQUASHFS_LSOCKET_TYPE   14
 
 #define SQUASHFS_DIR_INODE_NUMBER 1
+#define SQUASHFS_DIR_COUNT 256 // 每个dir header最多的entry数
+#define SQUASHFS_INVALID_XATTR 0xFFFFFFFF
 
 #define ZLIB_COMPRESSION	1
 #define LZMA_COMPRESSION	2
@@ -68,9 +70,9 @@ struct squashfs_super_block {
 };
 
 struct squashfs_dir_index {
-    uint32_t index;
-    uint32_t start_block;
-    uint32_t size;
+    uint32_t index; // 所指header相对目录列表开头的明文偏移
+    uint32_t start_block; // 该header所在metablock, 压缩后起始位置
+    uint32_t size; // 名字长度减1
     uint8_t name[0];
 };
 
@@ -120,6 +122,19 @@ struct squashfs_dir_inode {
     uint32_t parent_inode;
 };
 
+// 目录列表跨metablock或超过64KB时使用, 后接i_count个squashfs_dir_index
+struct squashfs_ldir_inode {
+    struct squashfs_inode_header header;
+    uint32_t nlink;
+    uint32_t file_size;
+    uint32_t start_block;
+    uint32_t parent_inode;
+    uint16_t i_count;
+    uint16_t offset;
+    uint32_t xattr;
+    struct squashfs_dir_index index[0];
+};
+
 struct squashfs_dir_entry {
     uint16_t offset; // inode偏移, 基于header指定的metablock明文
     int16_t inode_number;
@@ -130,7 +145,7 @@ struct squashfs_dir_entry {
 
 struct squashfs_dir_header {
     uint32_t count; // 不可大于256个
-    uint32_t start_block; // 明文的metablock的相对位置
+    uint32_t start_block; // entry所指inode的metablock, 压缩后相对inode表的起始位置
     uint32_t inode_number; // 可选, 它加entry的inode number得到目标inode number
 };
 
@@ -23,78 +23,18 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
 #include "deflate.h"
 #include "squeeze.h"
 #include "tree.h"
 #include "util.h"
 
-/*
-The "f" for the FindMinimum function below.
-i: the current parameter of f(i)
-context: for your implementation
-*/
-typedef double FindMinimumFun(size_t i, void* context);
-
-/*
-Finds minimum of function f(i) where is is of type size_t, f(i) is of type
-double, i is in range start-end (excluding end).
-Outputs the minimum value in *smallest and returns the index of this value.
-*/
-static size_t FindMinimum(FindMinimumFun f, void* context,
-                          size_t start, size_t end, double* smallest) {
-  if (end - start < 1024) {
-    double best = ZOPFLI_LARGE_FLOAT;
-    size_t result = start;
-    size_t i;
-    for (i = start; i < end; i++) {
-      double v = f(i, context);
-      if (v < best) {
-        best = v;
-        result = i;
-      }
-    }
-    *smallest = best;
-    return result;
-  } else {
-    /* Try to find minimum faster by recursively checking multiple points. */
-#define NUM 9  /* Good value: 9. */
-    size_t i;
-    size_t p[NUM];
-    double vp[NUM];
-    size_t besti;
-    double best;
-    double lastbest = ZOPFLI_LARGE_FLOAT;
-    size_t pos = start;
-
-    for (;;) {
-      if (end - start <= NUM) break;
-
-      for (i = 0; i < NUM; i++) {
-        p[i] = start + (i + 1) * ((end - start) / (NUM + 1));
-        vp[i] = f(p[i], context);
-      }
-      besti = 0;
-      best = vp[0];
-      for (i = 1; i < NUM; i++) {
-        if (vp[i] < best) {
-          best = vp[i];
-          besti = i;
-        }
-      }
-      if (best > lastbest) break;
-
-      start = besti == 0 ? start : p[besti - 1];
-      end = besti == NUM - 1 ? end : p[besti + 1];
-
-      pos = p[besti];
-      lastbest = best;
-    }
-    *smallest = lastbest;
-    return pos;
-#undef NUM
-  }
-}
-
 /*
 Returns estimated cost of a block in bits.  It includes the size to encode the
 tree and the size to encode all literal, length and distance symbols and their
@@ -110,21 +50,323 @@ static double EstimateCost(const ZopfliLZ77Store* lz77,
   return ZopfliCalculateBlockSizeAutoType(lz77, lstart, lend);
 }
 
-typedef struct SplitCostContext {
+/*
+Gets the cost which is the sum of the cost of the left and the right section
+of the data.
+*/
+static double SplitCost(const ZopfliLZ77Store* lz77,
+                        size_t start, size_t i, size_t end) {
+  return EstimateCost(lz77, start, i) + EstimateCost(lz77, i, end);
+}
+
+/* Amount of split positions per round of the search that zooms in on them. */
+#define SPLIT_GRID 9
+
+/* Blocks with less LZ77 symbols than this get the cost of every split. */
+#define SPLIT_EXHAUSTIVE_SYMBOLS 1024
+
+/* Maximum amount of threads that evaluate the split positions. */
+#define SPLIT_MAX_THREADS 16
+
+/*
+Batches of split positions whose blocks have less LZ77 symbols than this in
+total are evaluated on the calling thread only, waking the threads would cost
+more than it saves.
+*/
+#define SPLIT_THREADS_MIN_SYMBOLS 32768
+
+/*
+Threads that compute the exact cost of batches of split positions, started once
+for all splits of a ZopfliBlockSplitLZ77 call. The calling thread works on each
+batch too. Each thread claims the next positions of the batch until none are
+left, the costs go to the index of their position.
+*/
+typedef struct SplitPool {
+  int numthreads;  /* Amount of threads to use, including the calling one. */
+  int started;  /* Threads started so far, started on the first batch. */
+  int quit;
+  /* The current batch. */
   const ZopfliLZ77Store* lz77;
-  size_t start;
-  size_t end;
-} SplitCostContext;
+  size_t lstart;
+  size_t lend;
+  const size_t* points;
+  double* costs;  /* Output, the exact cost of each split position. */
+  size_t numpoints;
+  size_t next;  /* Next position to claim. */
+  size_t chunk;  /* Amount of positions claimed at once. */
+  size_t done;  /* Amount of positions evaluated. */
+#ifdef _WIN32
+  /* Only what Windows XP has, condition variables came with Vista. */
+  HANDLE threads[SPLIT_MAX_THREADS];
+  CRITICAL_SECTION lock;
+  HANDLE work;  /* Semaphore, released once per thread for a batch or quit. */
+  HANDLE finished;  /* Auto-reset event, set by the last position of a batch. */
+#else
+  pthread_t threads[SPLIT_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+#endif
+} SplitPool;
+
+static void LockSplitPool(SplitPool* pool) {
+#ifdef _WIN32
+  EnterCriticalSection(&pool->lock);
+#else
+  pthread_mutex_lock(&pool->lock);
+#endif
+}
 
+static void UnlockSplitPool(SplitPool* pool) {
+#ifdef _WIN32
+  LeaveCriticalSection(&pool->lock);
+#else
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
 
 /*
-Gets the cost which is the sum of the cost of the left and the right section
-of the data.
-type: FindMinimumFun
+Evaluates positions of the current batch until all are claimed. To be called
+with the lock held, which is released during each evaluation.
 */
-static double SplitCost(size_t i, void* context) {
-  SplitCostContext* c = (SplitCostContext*)context;
-  return EstimateCost(c->lz77, c->start, i) + EstimateCost(c->lz77, i, c->end);
+static void EvaluateClaimedSplits(SplitPool* pool) {
+  while (pool->next < pool->numpoints) {
+    size_t first = pool->next;
+    size_t end = first + pool->chunk < pool->numpoints
+        ? first + pool->chunk : pool->numpoints;
+    size_t j;
+    pool->next = end;
+    UnlockSplitPool(pool);
+    for (j = first; j < end; j++) {
+      pool->costs[j] = SplitCost(pool->lz77, pool->lstart, pool->points[j],
+                                 pool->lend);
+    }
+    LockSplitPool(pool);
+    pool->done += end - first;
+    if (pool->done == pool->numpoints) {
+#ifdef _WIN32
+      SetEvent(pool->finished);
+#else
+      pthread_cond_signal(&pool->finished);
+#endif
+    }
+  }
+}
+
+static void RunSplitWorker(SplitPool* pool) {
+  LockSplitPool(pool);
+  for (;;) {
+    while (!pool->quit && pool->next >= pool->numpoints) {
+#ifdef _WIN32
+      /* A count left from an earlier batch only makes this check again. */
+      UnlockSplitPool(pool);
+      WaitForSingleObject(pool->work, INFINITE);
+      LockSplitPool(pool);
+#else
+      pthread_cond_wait(&pool->work, &pool->lock);
+#endif
+    }
+    if (pool->quit) break;
+    EvaluateClaimedSplits(pool);
+  }
+  UnlockSplitPool(pool);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall SplitWorkerProc(void* arg) {
+  RunSplitWorker((SplitPool*)arg);
+  return 0;
+}
+#else
+static void* SplitWorkerProc(void* arg) {
+  RunSplitWorker((SplitPool*)arg);
+  return 0;
+}
+#endif
+
+static void InitSplitPool(int numthreads, SplitPool* pool) {
+  pool->numthreads = numthreads < 1 ? 1
+      : numthreads > SPLIT_MAX_THREADS ? SPLIT_MAX_THREADS : numthreads;
+  pool->started = 0;
+  pool->quit = 0;
+  pool->numpoints = 0;
+  pool->next = 0;
+  pool->chunk = 1;
+  pool->done = 0;
+  if (pool->numthreads == 1) return;
+#ifdef _WIN32
+  pool->work = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+  pool->finished = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!pool->work || !pool->finished) {
+    if (pool->work) CloseHandle(pool->work);
+    if (pool->finished) CloseHandle(pool->finished);
+    pool->numthreads = 1;
+    return;
+  }
+  InitializeCriticalSection(&pool->lock);
+#else
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+#endif
+}
+
+/* Stops and joins the threads. */
+static void CleanSplitPool(SplitPool* pool) {
+  int t;
+  if (pool->numthreads == 1) return;
+  LockSplitPool(pool);
+  pool->quit = 1;
+#ifdef _WIN32
+  if (pool->started > 0) ReleaseSemaphore(pool->work, pool->started, NULL);
+#else
+  pthread_cond_broadcast(&pool->work);
+#endif
+  UnlockSplitPool(pool);
+  for (t = 0; t < pool->started; t++) {
+#ifdef _WIN32
+    WaitForSingleObject(pool->threads[t], INFINITE);
+    CloseHandle(pool->threads[t]);
+#else
+    pthread_join(pool->threads[t], NULL);
+#endif
+  }
+#ifdef _WIN32
+  DeleteCriticalSection(&pool->lock);
+  CloseHandle(pool->finished);
+  CloseHandle(pool->work);
+#else
+  pthread_cond_destroy(&pool->finished);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+#endif
+}
+
+/*
+Computes the exact cost of each split position into costs. The evaluations only
+read the LZ77 store, so they are spread over the threads of the pool, which are
+started on the first batch large enough for them. If no thread starts, the
+calling thread does all the work.
+*/
+static void EvaluateSplits(SplitPool* pool, const ZopfliLZ77Store* lz77,
+                           size_t lstart, size_t lend,
+                           const size_t* points, size_t numpoints,
+                           double* costs) {
+  size_t j;
+  if (pool->numthreads == 1 || numpoints < 2
+      || (lend - lstart) * numpoints < SPLIT_THREADS_MIN_SYMBOLS) {
+    for (j = 0; j < numpoints; j++) {
+      costs[j] = SplitCost(lz77, lstart, points[j], lend);
+    }
+    return;
+  }
+
+  LockSplitPool(pool);
+  if (pool->started == 0) {
+    int t;
+    for (t = 0; t < pool->numthreads - 1; t++) {
+#ifdef _WIN32
+      HANDLE thread = (HANDLE)_beginthreadex(
+          NULL, 0, SplitWorkerProc, pool, 0, NULL);
+      if (!thread) break;
+      pool->threads[pool->started++] = thread;
+#else
+      if (pthread_create(&pool->threads[pool->started], NULL,
+                         SplitWorkerProc, pool) != 0) {
+        break;
+      }
+      pool->started++;
+#endif
+    }
+  }
+  pool->lz77 = lz77;
+  pool->lstart = lstart;
+  pool->lend = lend;
+  pool->points = points;
+  pool->costs = costs;
+  pool->numpoints = numpoints;
+  pool->next = 0;
+  /* About four claims per thread, fewer hold the threads up on the lock. */
+  pool->chunk = numpoints / (4 * (pool->started + 1));
+  if (pool->chunk < 1) pool->chunk = 1;
+  pool->done = 0;
+#ifdef _WIN32
+  if (pool->started > 0) ReleaseSemaphore(pool->work, pool->started, NULL);
+#else
+  pthread_cond_broadcast(&pool->work);
+#endif
+  EvaluateClaimedSplits(pool);
+  while (pool->done < pool->numpoints) {
+#ifdef _WIN32
+    /* May be set from an earlier batch, done is checked again. */
+    UnlockSplitPool(pool);
+    WaitForSingleObject(pool->finished, INFINITE);
+    LockSplitPool(pool);
+#else
+    pthread_cond_wait(&pool->finished, &pool->lock);
+#endif
+  }
+  UnlockSplitPool(pool);
+}
+
+/*
+Finds the best position to split the block lstart to lend in two, with the
+exact cost of both blocks. Small blocks try every position, larger ones
+SPLIT_GRID evenly spread points per round, each round zooming in between the
+neighbours of the lowest one, until that no longer improves. The evaluations of
+each round run on the threads of pool.
+Returns the split position, in range lstart + 1 to lend (not inclusive), and
+outputs its exact cost in *splitcost.
+*/
+static size_t FindSplit(SplitPool* pool, const ZopfliLZ77Store* lz77,
+                        size_t lstart, size_t lend, double* splitcost) {
+  size_t start = lstart + 1;
+  size_t end = lend;
+  size_t p[SPLIT_GRID];
+  double vp[SPLIT_GRID];
+  size_t i;
+  size_t pos = start;
+  double lastbest = ZOPFLI_LARGE_FLOAT;
+
+  if (end - start < SPLIT_EXHAUSTIVE_SYMBOLS) {
+    size_t n = end - start;
+    size_t* points = (size_t*)malloc(sizeof(*points) * n);
+    double* costs = (double*)malloc(sizeof(*costs) * n);
+    if (!points || !costs) exit(-1); /* Allocation failed. */
+    for (i = 0; i < n; i++) points[i] = start + i;
+    EvaluateSplits(pool, lz77, lstart, lend, points, n, costs);
+    /* In position order, so the result does not depend on the thread count. */
+    for (i = 0; i < n; i++) {
+      if (costs[i] < lastbest) {
+        lastbest = costs[i];
+        pos = points[i];
+      }
+    }
+    free(points);
+    free(costs);
+    *splitcost = lastbest;
+    return pos;
+  }
+
+  while (end - start > SPLIT_GRID) {
+    size_t besti = 0;
+    for (i = 0; i < SPLIT_GRID; i++) {
+      p[i] = start + (i + 1) * ((end - start) / (SPLIT_GRID + 1));
+    }
+    EvaluateSplits(pool, lz77, lstart, lend, p, SPLIT_GRID, vp);
+    for (i = 1; i < SPLIT_GRID; i++) {
+      if (vp[i] < vp[besti]) besti = i;
+    }
+    if (vp[besti] > lastbest) break;
+
+    start = besti == 0 ? start : p[besti - 1];
+    end = besti == SPLIT_GRID - 1 ? end : p[besti + 1];
+
+    pos = p[besti];
+    lastbest = vp[besti];
+  }
+  *splitcost = lastbest;
+  return pos;
 }
 
 static void AddSorted(size_t value, size_t** out, size_t* outsize) {
@@ -221,32 +463,31 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
   size_t numblocks = 1;
   unsigned char* done;
   double splitcost, origcost;
+  SplitPool pool;
 
   if (lz77->size < 10) return;  /* This code fails on tiny files. */
 
   done = (unsigned char*)malloc(lz77->size);
   if (!done) exit(-1); /* Allocation failed. */
   for (i = 0; i < lz77->size; i++) done[i] = 0;
+  InitSplitPool(options->blocksplittingthreads, &pool);
 
   lstart = 0;
   lend = lz77->size;
   for (;;) {
-    SplitCostContext c;
-
     if (maxblocks > 0 && numblocks >= maxblocks) {
       break;
     }
 
-    c.lz77 = lz77;
-    c.start = lstart;
-    c.end = lend;
     assert(lstart < lend);
-    llpos = FindMinimum(SplitCost, &c, lstart + 1, lend, &splitcost);
+    llpos = FindSplit(&pool, lz77, lstart, lend, &splitcost);
 
     assert(llpos > lstart);
     assert(llpos < lend);
 
     origcost = EstimateCost(lz77, lstart, lend);
+    /* One more block to build decoding tables for, see decodecost. */
+    splitcost += options->decodecost * ZOPFLI_DECODE_BLOCK_STEPS;
 
     if (splitcost > origcost || llpos == lstart + 1 || llpos == lend) {
       done[lstart] = 1;
@@ -269,6 +510,7 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     PrintBlockSplitPoints(lz77, *splitpoints, *npoints);
   }
 #endif
+  CleanSplitPool(&pool);
   free(done);
 }
 
@@ -287,6 +529,9 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   ZopfliInitLZ77Store(in, &store);
   ZopfliInitBlockState(options, instart, inend, 0, &s);
   ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  if (options->matchfinder == ZOPFLI_MATCHFINDER_BINARY_TREE) {
+    ZopfliAllocHashTree(ZOPFLI_WINDOW_SIZE, h);
+  }
 
   *npoints = 0;
   *splitpoints = 0;
@@ -25,16 +25,20 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
 
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
+void ZopfliInitCache(size_t blocksize, size_t cachelength,
+                     ZopfliLongestMatchCache* lmc) {
   size_t i;
+  lmc->cachelength = cachelength;
+  lmc->complete = 0;
   lmc->length = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
   lmc->dist = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
-  /* Rather large amount of memory. */
-  lmc->sublen = (unsigned char*)malloc(ZOPFLI_CACHE_LENGTH * 3 * blocksize);
+  /* Rather large amount of memory. One extra byte so that a cachelength of 0
+  still gives a valid pointer. */
+  lmc->sublen = (unsigned char*)malloc(cachelength * 3 * blocksize + 1);
   if(lmc->sublen == NULL) {
     fprintf(stderr,
         "Error: Out of memory. Tried allocating %lu bytes of memory.\n",
-        (unsigned long)ZOPFLI_CACHE_LENGTH * 3 * blocksize);
+        (unsigned long)cachelength * 3 * blocksize);
     exit (EXIT_FAILURE);
   }
 
@@ -42,7 +46,7 @@ void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
   that this cache value is not filled in yet. */
   for (i = 0; i < blocksize; i++) lmc->length[i] = 1;
   for (i = 0; i < blocksize; i++) lmc->dist[i] = 0;
-  for (i = 0; i < ZOPFLI_CACHE_LENGTH * blocksize * 3; i++) lmc->sublen[i] = 0;
+  for (i = 0; i < cachelength * blocksize * 3; i++) lmc->sublen[i] = 0;
 }
 
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc) {
@@ -59,11 +63,9 @@ void ZopfliSublenToCache(const unsigned short* sublen,
   unsigned bestlength = 0;
   unsigned char* cache;
 
-#if ZOPFLI_CACHE_LENGTH == 0
-  return;
-#endif
+  if (lmc->cachelength == 0) return;
 
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
+  cache = &lmc->sublen[lmc->cachelength * pos * 3];
   if (length < 3) return;
   for (i = 3; i <= length; i++) {
     if (i == length || sublen[i] != sublen[i + 1]) {
@@ -72,12 +74,12 @@ void ZopfliSublenToCache(const unsigned short* sublen,
       cache[j * 3 + 2] = (sublen[i] >> 8) % 256;
       bestlength = i;
       j++;
-      if (j >= ZOPFLI_CACHE_LENGTH) break;
+      if (j >= lmc->cachelength) break;
     }
   }
-  if (j < ZOPFLI_CACHE_LENGTH) {
+  if (j < lmc->cachelength) {
     assert(bestlength == length);
-    cache[(ZOPFLI_CACHE_LENGTH - 1) * 3] = bestlength - 3;
+    cache[(lmc->cachelength - 1) * 3] = bestlength - 3;
   } else {
     assert(bestlength <= length);
   }
@@ -91,12 +93,10 @@ void ZopfliCacheToSublen(const ZopfliLongestMatchCache* lmc,
   unsigned maxlength = ZopfliMaxCachedSublen(lmc, pos, length);
   unsigned prevlength = 0;
   unsigned char* cache;
-#if ZOPFLI_CACHE_LENGTH == 0
-  return;
-#endif
+  if (lmc->cachelength == 0) return;
   if (length < 3) return;
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
-  for (j = 0; j < ZOPFLI_CACHE_LENGTH; j++) {
+  cache = &lmc->sublen[lmc->cachelength * pos * 3];
+  for (j = 0; j < lmc->cachelength; j++) {
     unsigned length = cache[j * 3] + 3;
     unsigned dist = cache[j * 3 + 1] + 256 * cache[j * 3 + 2];
     for (i = prevlength; i <= length; i++) {
@@ -113,13 +113,30 @@ Returns the length up to which could be stored in the cache.
 unsigned ZopfliMaxCachedSublen(const ZopfliLongestMatchCache* lmc,
                                size_t pos, size_t length) {
   unsigned char* cache;
-#if ZOPFLI_CACHE_LENGTH == 0
-  return 0;
-#endif
-  cache = &lmc->sublen[ZOPFLI_CACHE_LENGTH * pos * 3];
+  if (lmc->cachelength == 0) return 0;
+  cache = &lmc->sublen[lmc->cachelength * pos * 3];
   (void)length;
   if (cache[1] == 0 && cache[2] == 0) return 0;  /* No sublen cached. */
-  return cache[(ZOPFLI_CACHE_LENGTH - 1) * 3] + 3;
+  return cache[(lmc->cachelength - 1) * 3] + 3;
+}
+
+int ZopfliCacheComplete(const ZopfliLongestMatchCache* lmc,
+                        size_t start, size_t end, size_t blocksize) {
+  size_t i;
+  if (blocksize < ZOPFLI_MIN_MATCH) return 1;
+  if (end > blocksize - ZOPFLI_MIN_MATCH + 1) {
+    end = blocksize - ZOPFLI_MIN_MATCH + 1;
+  }
+  for (i = start; i < end; i++) {
+    unsigned short length = lmc->length[i];
+    /* Length > 0 and dist 0 means not filled in yet. */
+    if (length != 0 && lmc->dist[i] == 0) return 0;
+    if (length >= ZOPFLI_MIN_MATCH
+        && length > ZopfliMaxCachedSublen(lmc, i, length)) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 #endif  /* ZOPFLI_LONGEST_MATCH_CACHE */
@@ -40,10 +40,21 @@ typedef struct ZopfliLongestMatchCache {
   unsigned short* length;
   unsigned short* dist;
   unsigned char* sublen;
+  /* Amount of sublen breakpoints kept per position, see ZOPFLI_CACHE_LENGTH. */
+  size_t cachelength;
+  /*
+  Whether every position of the block has its full sublen cached, so that the
+  cache answers every search and the hash is not needed anymore.
+  */
+  int complete;
 } ZopfliLongestMatchCache;
 
-/* Initializes the ZopfliLongestMatchCache. */
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
+/*
+Initializes the ZopfliLongestMatchCache, keeping cachelength sublen breakpoints
+per position.
+*/
+void ZopfliInitCache(size_t blocksize, size_t cachelength,
+                     ZopfliLongestMatchCache* lmc);
 
 /* Frees up the memory of the ZopfliLongestMatchCache. */
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc);
@@ -61,6 +72,14 @@ void ZopfliCacheToSublen(const ZopfliLongestMatchCache* lmc,
 unsigned ZopfliMaxCachedSublen(const ZopfliLongestMatchCache* lmc,
                                size_t pos, size_t length);
 
+/*
+Returns whether the positions from start to end (not inclusive, relative to
+the block start) all have their full sublen in the cache. Positions closer
+than ZOPFLI_MIN_MATCH to blocksize never need a search.
+*/
+int ZopfliCacheComplete(const ZopfliLongestMatchCache* lmc,
+                        size_t start, size_t end, size_t blocksize);
+
 #endif  /* ZOPFLI_LONGEST_MATCH_CACHE */
 
 #endif  /* ZOPFLI_CACHE_H_ */
@@ -0,0 +1,196 @@
+#include "checksum.h"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <emmintrin.h>
+#define ZOPFLI_ADLER32_SSE2
+#define ZOPFLI_TARGET_SSE2
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#include <emmintrin.h>
+#define ZOPFLI_ADLER32_SSE2
+#define ZOPFLI_TARGET_SSE2 __attribute__((target("sse2")))
+#endif
+
+/* Largest prime smaller than 65536. */
+#define ADLER32_BASE 65521u
+/*
+Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1, so the sums can be
+left unreduced for this many bytes. It is a multiple of 16 on purpose, the SSE2
+path consumes 16 bytes per step.
+*/
+#define ADLER32_NMAX 5552
+
+static unsigned Adler32Scalar(unsigned adler,
+                              const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = adler >> 16;
+
+  while (size > 0) {
+    size_t amount = size > ADLER32_NMAX ? ADLER32_NMAX : size;
+    size -= amount;
+    while (amount >= 8) {
+      s1 += data[0]; s2 += s1;
+      s1 += data[1]; s2 += s1;
+      s1 += data[2]; s2 += s1;
+      s1 += data[3]; s2 += s1;
+      s1 += data[4]; s2 += s1;
+      s1 += data[5]; s2 += s1;
+      s1 += data[6]; s2 += s1;
+      s1 += data[7]; s2 += s1;
+      data += 8;
+      amount -= 8;
+    }
+    while (amount > 0) {
+      s1 += *data++;
+      s2 += s1;
+      amount--;
+    }
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+#ifdef ZOPFLI_ADLER32_SSE2
+/*
+Vertical sum adler32: per 16 byte step, the plain byte sum goes to s1 through
+_mm_sad_epu8, the sum weighted with 16..1 goes to s2 through _mm_madd_epi16, and
+the s1 value before the step is accumulated separately since it contributes
+16 times to s2. Only the tail shorter than 16 bytes is done byte by byte.
+*/
+ZOPFLI_TARGET_SSE2
+static unsigned Adler32SSE2(unsigned adler,
+                            const unsigned char* data, size_t size) {
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = adler >> 16;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weights_hi = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+  const __m128i weights_lo = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+
+  while (size >= 16) {
+    size_t amount = size > ADLER32_NMAX ? ADLER32_NMAX : size;
+    size_t steps = amount / 16;
+    __m128i v_s1 = zero;  /* Byte sums, in the two 64-bit lanes. */
+    __m128i v_ps = zero;  /* Sum of v_s1 before each step. */
+    __m128i v_s2 = zero;  /* Weighted byte sums, four 32-bit lanes. */
+    unsigned sum1, prefix, sum2;
+    size_t i;
+
+    for (i = 0; i < steps; i++) {
+      __m128i bytes = _mm_loadu_si128((const __m128i*)data);
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+          _mm_unpacklo_epi8(bytes, zero), weights_hi));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+          _mm_unpackhi_epi8(bytes, zero), weights_lo));
+      data += 16;
+    }
+
+    /* Horizontal sums. v_s1 and v_ps only use the low 32 bits of each half. */
+    sum1 = (unsigned)_mm_cvtsi128_si32(v_s1)
+        + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(v_s1, 8));
+    prefix = (unsigned)_mm_cvtsi128_si32(v_ps)
+        + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(v_ps, 8));
+    v_s2 = _mm_add_epi32(v_s2, _mm_srli_si128(v_s2, 8));
+    v_s2 = _mm_add_epi32(v_s2, _mm_srli_si128(v_s2, 4));
+    sum2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+    s2 += s1 * (unsigned)(steps * 16) + prefix * 16 + sum2;
+    s1 += sum1;
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
+    size -= steps * 16;
+  }
+
+  return Adler32Scalar((s2 << 16) | s1, data, size);
+}
+
+/* Returns whether the CPU supports SSE2, from CPUID leaf 1, EDX bit 26. */
+static int HasSSE2(void) {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] >> 26) & 1;
+#else
+  unsigned a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+  return (d >> 26) & 1;
+#endif
+}
+#endif  /* ZOPFLI_ADLER32_SSE2 */
+
+typedef unsigned Adler32Fun(unsigned adler,
+                            const unsigned char* data, size_t size);
+
+unsigned ZopfliUpdateAdler32(unsigned adler,
+                             const unsigned char* data, size_t size) {
+  /* Selected on the first call. Concurrent first calls all store the same
+  value, so no locking is needed. */
+  static Adler32Fun* volatile impl = 0;
+  if (!impl) {
+#ifdef ZOPFLI_ADLER32_SSE2
+    impl = HasSSE2() ? Adler32SSE2 : Adler32Scalar;
+#else
+    impl = Adler32Scalar;
+#endif
+  }
+  return impl(adler, data, size);
+}
+
+/*
+Slicing-by-8 tables for the reflected polynomial 0xedb88320. crc32_table[0] is
+the classic byte-wise table, crc32_table[k][i] is the CRC of byte i followed by
+k zero bytes.
+*/
+static unsigned crc32_table[8][256];
+static volatile int crc32_table_ready = 0;
+
+static void MakeCRC32Table(void) {
+  unsigned i, k;
+  for (i = 0; i < 256; i++) {
+    unsigned c = i;
+    for (k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc32_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    unsigned c = crc32_table[0][i];
+    for (k = 1; k < 8; k++) {
+      c = crc32_table[0][c & 0xff] ^ (c >> 8);
+      crc32_table[k][i] = c;
+    }
+  }
+  /* Like the adler32 selection, racing threads compute identical tables. */
+  crc32_table_ready = 1;
+}
+
+unsigned long ZopfliUpdateCRC32(unsigned long crc,
+                                const unsigned char* data, size_t size) {
+  unsigned c = (unsigned)crc ^ 0xffffffffu;
+
+  if (!crc32_table_ready) MakeCRC32Table();
+
+  /* 8 bytes per step, read as two little endian words. */
+  while (size >= 8) {
+    unsigned lo = c ^ ((unsigned)data[0] | ((unsigned)data[1] << 8)
+        | ((unsigned)data[2] << 16) | ((unsigned)data[3] << 24));
+    unsigned hi = (unsigned)data[4] | ((unsigned)data[5] << 8)
+        | ((unsigned)data[6] << 16) | ((unsigned)data[7] << 24);
+    c = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff]
+        ^ crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24]
+        ^ crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff]
+        ^ crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    c = crc32_table[0][(c ^ *data++) & 0xff] ^ (c >> 8);
+    size--;
+  }
+
+  return c ^ 0xffffffffu;
+}
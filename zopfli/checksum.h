@@ -0,0 +1,46 @@
+/*
+Checksums used by the zlib and gzip containers: adler32 (RFC 1950) and CRC32
+(RFC 1952).
+
+Both functions are incremental, so the checksum can be updated chunk by chunk
+while the data is being read or gathered, instead of costing a separate pass
+over the whole input right before compression. The adler32 uses SSE2 vertical
+sums when the CPU supports it (checked once at runtime), the CRC32 uses the
+slicing-by-8 table method.
+*/
+
+#ifndef ZOPFLI_CHECKSUM_H_
+#define ZOPFLI_CHECKSUM_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Initial value to pass to ZopfliUpdateAdler32 for new data. */
+#define ZOPFLI_ADLER32_INIT 1u
+
+/* Initial value to pass to ZopfliUpdateCRC32 for new data. */
+#define ZOPFLI_CRC32_INIT 0u
+
+/*
+Updates the adler32 checksum with size more bytes of data and returns the new
+checksum. Start with ZOPFLI_ADLER32_INIT.
+*/
+unsigned ZopfliUpdateAdler32(unsigned adler,
+                             const unsigned char* data, size_t size);
+
+/*
+Updates the CRC32 with size more bytes of data and returns the new CRC. Start
+with ZOPFLI_CRC32_INIT. The pre and post conditioning is done inside, so the
+returned value is always the final CRC of all data so far.
+*/
+unsigned long ZopfliUpdateCRC32(unsigned long crc,
+                                const unsigned char* data, size_t size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  /* ZOPFLI_CHECKSUM_H_ */
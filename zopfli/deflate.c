@@ -35,39 +35,131 @@ Given the value of bp and the amount of bytes, the amount of bits represented
 is not simply bytesize * 8 + bp because even representing one bit requires a
 whole byte. It is: (bp == 0) ? (bytesize * 8) : ((bytesize - 1) * 8 + bp)
 */
-static void AddBit(int bit,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (*bp == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-  (*out)[*outsize - 1] |= bit << *bp;
-  *bp = (*bp + 1) & 7;
+
+/*
+Writes bits to a dynamic output array (out, outsize, bp) through a 32-bit
+accumulator, storing 32 bits at once instead of appending byte by byte. The
+array keeps the ZOPFLI_APPEND_DATA layout, its allocation is a power of two that
+fits the size, so the containers can keep appending to it afterwards.
+*/
+typedef struct BitWriter {
+  unsigned char** out;  /* Written back by FinishBitWriter. */
+  size_t* outsize;
+  unsigned char* bp;
+  unsigned char* data;
+  size_t size;  /* Whole bytes stored in data. */
+  size_t capacity;  /* Allocated bytes of data. */
+  /* Pending bits, the first one in the lowest bit. Only the low 32 bits are
+  used, unsigned long since C89 has no 64-bit type. */
+  unsigned long acc;
+  unsigned bits;  /* Amount of pending bits, below 32 between calls. */
+} BitWriter;
+
+/* Starts writing after the bits already in the output array. */
+static void InitBitWriter(unsigned char* bp, unsigned char** out,
+                          size_t* outsize, BitWriter* w) {
+  w->out = out;
+  w->outsize = outsize;
+  w->bp = bp;
+  w->data = *out;
+  w->size = *outsize;
+  w->capacity = 0;
+  if (w->size > 0) {
+    w->capacity = 1;
+    while (w->capacity < w->size) w->capacity *= 2;
+  }
+  w->acc = 0;
+  w->bits = 0;
+  if (*bp != 0) {
+    /* The unfinished last byte goes back into the accumulator. */
+    w->size--;
+    w->acc = w->data[w->size] & ((1u << *bp) - 1);
+    w->bits = *bp;
+  }
+}
+
+/* Makes room for at least amount more bytes. */
+static void ReserveBitWriter(BitWriter* w, size_t amount) {
+  size_t needed = w->size + amount + 8;
+  size_t capacity = w->capacity == 0 ? 1 : w->capacity;
+  if (needed <= w->capacity) return;
+  while (capacity < needed) capacity *= 2;
+  w->data = (unsigned char*)realloc(w->data, capacity);
+  if (!w->data) exit(-1); /* Allocation failed. */
+  w->capacity = capacity;
+}
+
+/* Stores the whole bytes of the accumulator. */
+static void FlushBitWriter(BitWriter* w) {
+  if (w->size + 8 > w->capacity) ReserveBitWriter(w, 8);
+  while (w->bits >= 8) {
+    w->data[w->size++] = (unsigned char)w->acc;
+    w->acc >>= 8;
+    w->bits -= 8;
+  }
+}
+
+/* Adds the length lowest bits of value, the lowest bit first. */
+static void AddBits(unsigned value, unsigned length, BitWriter* w) {
+  assert(length <= 16 && (value >> length) == 0);
+  w->acc |= (unsigned long)value << w->bits;
+  if (w->bits + length >= 32) {
+    /* The low 32 bits are full, the rest of value starts the next ones. Since
+    length is at most 16, bits is at least 16 here and the shift is valid. */
+    unsigned char* p;
+    if (w->size + 4 > w->capacity) ReserveBitWriter(w, 4);
+    p = w->data + w->size;
+    p[0] = (unsigned char)w->acc;
+    p[1] = (unsigned char)(w->acc >> 8);
+    p[2] = (unsigned char)(w->acc >> 16);
+    p[3] = (unsigned char)(w->acc >> 24);
+    w->size += 4;
+    w->acc = value >> (32 - w->bits);
+    w->bits += length - 32;
+  } else {
+    w->bits += length;
+  }
 }
 
-static void AddBits(unsigned symbol, unsigned length,
-                    unsigned char* bp, unsigned char** out, size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> i) & 1;
-    if (*bp == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+/* Pads the pending bits with zeros up to the next byte boundary. */
+static void AlignBitWriter(BitWriter* w) {
+  w->bits = (w->bits + 7) & ~7u;
+  FlushBitWriter(w);
+}
+
+/* Stores the pending bits and writes the array back to out, outsize and bp. */
+static void FinishBitWriter(BitWriter* w) {
+  unsigned bp = w->bits & 7;
+  FlushBitWriter(w);
+  if (bp != 0) {
+    w->data[w->size++] = (unsigned char)w->acc;
   }
+  if (w->size == 0) {
+    /* ZOPFLI_APPEND_DATA expects no allocation at size 0. */
+    free(w->data);
+    w->data = 0;
+  }
+  *w->out = w->data;
+  *w->outsize = w->size;
+  *w->bp = (unsigned char)bp;
 }
 
 /*
-Adds bits, like AddBits, but the order is inverted. The deflate specification
-uses both orders in one standard.
+Reverses the Huffman codes from ZopfliLengthsToSymbols in place. Deflate stores
+Huffman codes starting from their most significant bit, while AddBits writes
+the lowest bit first, so the reversed codes can be written with AddBits.
 */
-static void AddHuffmanBits(unsigned symbol, unsigned length,
-                           unsigned char* bp, unsigned char** out,
-                           size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> (length - i - 1)) & 1;
-    if (*bp == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << *bp;
-    *bp = (*bp + 1) & 7;
+static void ReverseSymbols(const unsigned* lengths, size_t n,
+                           unsigned* symbols) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned symbol = symbols[i];
+    unsigned reversed = 0;
+    unsigned j;
+    for (j = 0; j < lengths[i]; j++) {
+      reversed = (reversed << 1) | ((symbol >> j) & 1);
+    }
+    symbols[i] = reversed;
   }
 }
 
@@ -99,14 +191,13 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
 }
 
 /*
-Encodes the Huffman tree and returns how many bits its encoding takes. If out
+Encodes the Huffman tree and returns how many bits its encoding takes. If w
 is a null pointer, only returns the size and runs faster.
 */
 static size_t EncodeTree(const unsigned* ll_lengths,
                          const unsigned* d_lengths,
                          int use_16, int use_17, int use_18,
-                         unsigned char* bp,
-                         unsigned char** out, size_t* outsize) {
+                         BitWriter* w) {
   unsigned lld_total;  /* Total amount of literal, length, distance codes. */
   /* Runlength encoded version of lengths of litlen and dist trees. */
   unsigned* rle = 0;
@@ -125,7 +216,7 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   static const unsigned order[19] = {
     16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
   };
-  int size_only = !out;
+  int size_only = !w;
   size_t result_size = 0;
 
   for(i = 0; i < 19; i++) clcounts[i] = 0;
@@ -206,28 +297,31 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   }
 
   ZopfliCalculateBitLengths(clcounts, 19, 7, clcl);
-  if (!size_only) ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
+  if (!size_only) {
+    ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
+    ReverseSymbols(clcl, 19, clsymbols);
+  }
 
   hclen = 15;
   /* Trim zeros. */
   while (hclen > 0 && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
 
   if (!size_only) {
-    AddBits(hlit, 5, bp, out, outsize);
-    AddBits(hdist, 5, bp, out, outsize);
-    AddBits(hclen, 4, bp, out, outsize);
+    AddBits(hlit, 5, w);
+    AddBits(hdist, 5, w);
+    AddBits(hclen, 4, w);
 
     for (i = 0; i < hclen + 4; i++) {
-      AddBits(clcl[order[i]], 3, bp, out, outsize);
+      AddBits(clcl[order[i]], 3, w);
     }
 
     for (i = 0; i < rle_size; i++) {
       unsigned symbol = clsymbols[rle[i]];
-      AddHuffmanBits(symbol, clcl[rle[i]], bp, out, outsize);
+      AddBits(symbol, clcl[rle[i]], w);
       /* Extra bits. */
-      if (rle[i] == 16) AddBits(rle_bits[i], 2, bp, out, outsize);
-      else if (rle[i] == 17) AddBits(rle_bits[i], 3, bp, out, outsize);
-      else if (rle[i] == 18) AddBits(rle_bits[i], 7, bp, out, outsize);
+      if (rle[i] == 16) AddBits(rle_bits[i], 2, w);
+      else if (rle[i] == 17) AddBits(rle_bits[i], 3, w);
+      else if (rle[i] == 18) AddBits(rle_bits[i], 7, w);
     }
   }
 
@@ -248,59 +342,161 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   return result_size;
 }
 
-static void AddDynamicTree(const unsigned* ll_lengths,
-                           const unsigned* d_lengths,
-                           unsigned char* bp,
-                           unsigned char** out, size_t* outsize) {
-  int i;
-  int best = 0;
-  size_t bestsize = 0;
+/*
+Adds a run of count times the code length symbol to the code length code counts
+the way EncodeTree encodes it with the given use_16, use_17 and use_18.
+*/
+static void AddTreeRun(unsigned symbol, unsigned count,
+                       int use_16, int use_17, int use_18, size_t* clcounts) {
+  /* Repetitions of zeroes */
+  if (symbol == 0 && count >= 3) {
+    if (use_18) {
+      while (count >= 11) {
+        unsigned count2 = count > 138 ? 138 : count;
+        clcounts[18]++;
+        count -= count2;
+      }
+    }
+    if (use_17) {
+      while (count >= 3) {
+        unsigned count2 = count > 10 ? 10 : count;
+        clcounts[17]++;
+        count -= count2;
+      }
+    }
+  }
 
-  for(i = 0; i < 8; i++) {
-    size_t size = EncodeTree(ll_lengths, d_lengths,
-                             i & 1, i & 2, i & 4,
-                             0, 0, 0);
-    if (bestsize == 0 || size < bestsize) {
-      bestsize = size;
-      best = i;
+  /* Repetitions of any symbol */
+  if (use_16 && count >= 4) {
+    count--;  /* Since the first one is hardcoded. */
+    clcounts[symbol]++;
+    while (count >= 3) {
+      unsigned count2 = count > 6 ? 6 : count;
+      clcounts[16]++;
+      count -= count2;
     }
   }
 
-  EncodeTree(ll_lengths, d_lengths,
-             best & 1, best & 2, best & 4,
-             bp, out, outsize);
+  /* No or insufficient repetition */
+  clcounts[symbol] += count;
 }
 
 /*
-Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
+Gives the sizes in bits that EncodeTree returns for all 8 combinations of
+use_16, use_17 and use_18, indexed with use_16 as bit 0, use_17 as bit 1 and
+use_18 as bit 2. The runs of equal code lengths are found in a single pass and
+counted for all combinations at once, nothing is encoded.
 */
-static size_t CalculateTreeSize(const unsigned* ll_lengths,
-                                const unsigned* d_lengths) {
-  size_t result = 0;
+static void CalculateTreeSizes(const unsigned* ll_lengths,
+                               const unsigned* d_lengths, size_t* sizes) {
+  unsigned lld_total;  /* Total amount of literal, length, distance codes. */
+  unsigned hlit = 29;  /* 286 - 257 */
+  unsigned hdist = 29;  /* 32 - 1, but gzip does not like hdist > 29.*/
+  unsigned hclen;
+  unsigned hlit2;
+  size_t i, j;
+  int v;
+  size_t clcounts[8][19];
+  unsigned clcl[19];  /* Code length code lengths. */
+  /* The order in which code length code lengths are encoded as per deflate. */
+  static const unsigned order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+
+  memset(clcounts, 0, sizeof(clcounts));
+
+  /* Trim zeros. */
+  while (hlit > 0 && ll_lengths[257 + hlit - 1] == 0) hlit--;
+  while (hdist > 0 && d_lengths[1 + hdist - 1] == 0) hdist--;
+  hlit2 = hlit + 257;
+
+  lld_total = hlit2 + hdist + 1;
+
+  for (i = 0; i < lld_total; i = j) {
+    unsigned symbol = i < hlit2 ? ll_lengths[i] : d_lengths[i - hlit2];
+    for (j = i + 1; j < lld_total && symbol ==
+        (j < hlit2 ? ll_lengths[j] : d_lengths[j - hlit2]); j++) {
+    }
+    if (j - i < 3) {
+      /* Too short to be encoded as a repetition by any combination. */
+      for (v = 0; v < 8; v++) clcounts[v][symbol] += j - i;
+      continue;
+    }
+    for (v = 0; v < 8; v++) {
+      AddTreeRun(symbol, j - i, v & 1, v & 2, v & 4, clcounts[v]);
+    }
+  }
+
+  for (v = 0; v < 8; v++) {
+    size_t* counts = clcounts[v];
+    size_t size = 0;
+    ZopfliCalculateBitLengths(counts, 19, 7, clcl);
+
+    hclen = 15;
+    /* Trim zeros. */
+    while (hclen > 0 && counts[order[hclen + 4 - 1]] == 0) hclen--;
+
+    size += 14;  /* hlit, hdist, hclen bits */
+    size += (hclen + 4) * 3;  /* clcl bits */
+    for(i = 0; i < 19; i++) {
+      size += clcl[i] * counts[i];
+    }
+    /* Extra bits. */
+    size += counts[16] * 2;
+    size += counts[17] * 3;
+    size += counts[18] * 7;
+    sizes[v] = size;
+  }
+}
+
+/*
+Gives the combination of use_16, use_17 and use_18 that encodes the tree in the
+least bits, as index of CalculateTreeSizes, and outputs that size.
+*/
+static int GetBestTreeEncoding(const unsigned* ll_lengths,
+                               const unsigned* d_lengths, size_t* size) {
+  size_t sizes[8];
   int i;
+  int best = 0;
 
-  for(i = 0; i < 8; i++) {
-    size_t size = EncodeTree(ll_lengths, d_lengths,
-                             i & 1, i & 2, i & 4,
-                             0, 0, 0);
-    if (result == 0 || size < result) result = size;
+  CalculateTreeSizes(ll_lengths, d_lengths, sizes);
+  for(i = 1; i < 8; i++) {
+    if (sizes[i] < sizes[best]) best = i;
   }
+  *size = sizes[best];
+  return best;
+}
 
-  return result;
+static void AddDynamicTree(const unsigned* ll_lengths,
+                           const unsigned* d_lengths,
+                           BitWriter* w) {
+  size_t size;
+  int best = GetBestTreeEncoding(ll_lengths, d_lengths, &size);
+  EncodeTree(ll_lengths, d_lengths, best & 1, best & 2, best & 4, w);
+}
+
+/*
+Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
+*/
+static size_t CalculateTreeSize(const unsigned* ll_lengths,
+                                const unsigned* d_lengths) {
+  size_t size;
+  GetBestTreeEncoding(ll_lengths, d_lengths, &size);
+  return size;
 }
 
 /*
 Adds all lit/len and dist codes from the lists as huffman symbols. Does not add
 end code 256. expected_data_size is the uncompressed block size, used for
-assert, but you can set it to 0 to not do the assertion.
+assert, but you can set it to 0 to not do the assertion. The symbols must be
+bit reversed with ReverseSymbols.
 */
 static void AddLZ77Data(const ZopfliLZ77Store* lz77,
                         size_t lstart, size_t lend,
                         size_t expected_data_size,
                         const unsigned* ll_symbols, const unsigned* ll_lengths,
                         const unsigned* d_symbols, const unsigned* d_lengths,
-                        unsigned char* bp,
-                        unsigned char** out, size_t* outsize) {
+                        BitWriter* w) {
   size_t testlength = 0;
   size_t i;
 
@@ -310,7 +506,7 @@ static void AddLZ77Data(const ZopfliLZ77Store* lz77,
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
+      AddBits(ll_symbols[litlen], ll_lengths[litlen], w);
       testlength++;
     } else {
       unsigned lls = ZopfliGetLengthSymbol(litlen);
@@ -318,14 +514,12 @@ static void AddLZ77Data(const ZopfliLZ77Store* lz77,
       assert(litlen >= 3 && litlen <= 288);
       assert(ll_lengths[lls] > 0);
       assert(d_lengths[ds] > 0);
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
+      AddBits(ll_symbols[lls], ll_lengths[lls], w);
       AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
-              bp, out, outsize);
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
+              ZopfliGetLengthExtraBits(litlen), w);
+      AddBits(d_symbols[ds], d_lengths[ds], w);
       AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
-              bp, out, outsize);
+              ZopfliGetDistExtraBits(dist), w);
       testlength += litlen;
     }
   }
@@ -547,6 +741,11 @@ static double TryOptimizeHuffmanForRle(
   ZopfliCalculateBitLengths(d_counts2, ZOPFLI_NUM_D, 15, d_lengths2);
   PatchDistanceCodesForBuggyDecoders(d_lengths2);
 
+  /* The RLE friendly counts often give the same lengths. */
+  if (memcmp(ll_lengths, ll_lengths2, sizeof(ll_lengths2)) == 0
+      && memcmp(d_lengths, d_lengths2, sizeof(d_lengths2)) == 0) {
+    return treesize + datasize;
+  }
   treesize2 = CalculateTreeSize(ll_lengths2, d_lengths2);
   datasize2 = CalculateBlockSymbolSizeGivenCounts(ll_counts, d_counts,
       ll_lengths2, d_lengths2, lz77, lstart, lend);
@@ -620,17 +819,30 @@ double ZopfliCalculateBlockSizeAutoType(const ZopfliLZ77Store* lz77,
       : (fixedcost < dyncost ? fixedcost : dyncost);
 }
 
+double ZopfliCalculateDecodeCost(const ZopfliOptions* options,
+                                 const ZopfliLZ77Store* lz77,
+                                 size_t lstart, size_t lend) {
+  size_t steps = 0;
+  size_t i;
+  if (options->decodecost <= 0) return 0;
+  for (i = lstart; i < lend; i++) {
+    if (lz77->dists[i] == 0) {
+      steps++;
+    } else {
+      steps += lz77->dists[i] > ZOPFLI_DECODE_NEAR_DISTANCE ? 3 : 2;
+    }
+  }
+  return steps * options->decodecost;
+}
+
 /* Since an uncompressed block can be max 65535 in size, it actually adds
 multible blocks if needed. */
 static void AddNonCompressedBlock(const ZopfliOptions* options, int final,
                                   const unsigned char* in, size_t instart,
-                                  size_t inend,
-                                  unsigned char* bp,
-                                  unsigned char** out, size_t* outsize) {
+                                  size_t inend, BitWriter* w) {
   size_t pos = instart;
   (void)options;
   for (;;) {
-    size_t i;
     unsigned short blocksize = 65535;
     unsigned short nlen;
     int currentfinal;
@@ -640,22 +852,19 @@ static void AddNonCompressedBlock(const ZopfliOptions* options, int final,
 
     nlen = ~blocksize;
 
-    AddBit(final && currentfinal, bp, out, outsize);
+    AddBits(final && currentfinal, 1, w);
     /* BTYPE 00 */
-    AddBit(0, bp, out, outsize);
-    AddBit(0, bp, out, outsize);
+    AddBits(0, 2, w);
 
     /* Any bits of input up to the next byte boundary are ignored. */
-    *bp = 0;
+    AlignBitWriter(w);
 
-    ZOPFLI_APPEND_DATA(blocksize % 256, out, outsize);
-    ZOPFLI_APPEND_DATA((blocksize / 256) % 256, out, outsize);
-    ZOPFLI_APPEND_DATA(nlen % 256, out, outsize);
-    ZOPFLI_APPEND_DATA((nlen / 256) % 256, out, outsize);
+    AddBits(blocksize, 16, w);
+    AddBits(nlen, 16, w);
 
-    for (i = 0; i < blocksize; i++) {
-      ZOPFLI_APPEND_DATA(in[pos + i], out, outsize);
-    }
+    ReserveBitWriter(w, blocksize);
+    memcpy(w->data + w->size, in + pos, blocksize);
+    w->size += blocksize;
 
     if (currentfinal) break;
     pos += blocksize;
@@ -675,21 +884,17 @@ lstart: where to start in the LZ77 data
 lend: where to end in the LZ77 data (not inclusive)
 expected_data_size: the uncompressed block size, used for assert, but you can
   set it to 0 to not do the assertion.
-bp: output bit pointer
-out: dynamic output array to append to
-outsize: dynamic output array size
+w: the output
 */
 static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
                          const ZopfliLZ77Store* lz77,
                          size_t lstart, size_t lend,
-                         size_t expected_data_size,
-                         unsigned char* bp,
-                         unsigned char** out, size_t* outsize) {
+                         size_t expected_data_size, BitWriter* w) {
   unsigned ll_lengths[ZOPFLI_NUM_LL];
   unsigned d_lengths[ZOPFLI_NUM_D];
   unsigned ll_symbols[ZOPFLI_NUM_LL];
   unsigned d_symbols[ZOPFLI_NUM_D];
-  size_t detect_block_size = *outsize;
+  size_t detect_block_size = w->size;
   size_t compressed_size;
   size_t uncompressed_size = 0;
   size_t i;
@@ -697,14 +902,12 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
     size_t length = ZopfliLZ77GetByteRange(lz77, lstart, lend);
     size_t pos = lstart == lend ? 0 : lz77->pos[lstart];
     size_t end = pos + length;
-    AddNonCompressedBlock(options, final,
-                          lz77->data, pos, end, bp, out, outsize);
+    AddNonCompressedBlock(options, final, lz77->data, pos, end, w);
     return;
   }
 
-  AddBit(final, bp, out, outsize);
-  AddBit(btype & 1, bp, out, outsize);
-  AddBit((btype & 2) >> 1, bp, out, outsize);
+  AddBits(final, 1, w);
+  AddBits(btype, 2, w);
 
   if (btype == 1) {
     /* Fixed block. */
@@ -716,29 +919,30 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
 
     GetDynamicLengths(lz77, lstart, lend, ll_lengths, d_lengths);
 
-    detect_tree_size = *outsize;
-    AddDynamicTree(ll_lengths, d_lengths, bp, out, outsize);
+    detect_tree_size = w->size;
+    AddDynamicTree(ll_lengths, d_lengths, w);
 #ifdef _VERBOSE
     if (options->verbose) {
-      fprintf(stderr, "treesize: %d\n", (int)(*outsize - detect_tree_size));
+      fprintf(stderr, "treesize: %d\n", (int)(w->size - detect_tree_size));
     }
 #endif
   }
 
   ZopfliLengthsToSymbols(ll_lengths, ZOPFLI_NUM_LL, 15, ll_symbols);
   ZopfliLengthsToSymbols(d_lengths, ZOPFLI_NUM_D, 15, d_symbols);
+  ReverseSymbols(ll_lengths, ZOPFLI_NUM_LL, ll_symbols);
+  ReverseSymbols(d_lengths, ZOPFLI_NUM_D, d_symbols);
 
-  detect_block_size = *outsize;
+  detect_block_size = w->size;
   AddLZ77Data(lz77, lstart, lend, expected_data_size,
-              ll_symbols, ll_lengths, d_symbols, d_lengths,
-              bp, out, outsize);
+              ll_symbols, ll_lengths, d_symbols, d_lengths, w);
   /* End symbol. */
-  AddHuffmanBits(ll_symbols[256], ll_lengths[256], bp, out, outsize);
+  AddBits(ll_symbols[256], ll_lengths[256], w);
 
   for (i = lstart; i < lend; i++) {
     uncompressed_size += lz77->dists[i] == 0 ? 1 : lz77->litlens[i];
   }
-  compressed_size = *outsize - detect_block_size;
+  compressed_size = w->size - detect_block_size;
 #ifdef _VERBOSE
   if (options->verbose) {
     fprintf(stderr, "compressed block size: %d (%dk) (unc: %d)\n",
@@ -751,12 +955,13 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
 static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
                                  const ZopfliLZ77Store* lz77,
                                  size_t lstart, size_t lend,
-                                 size_t expected_data_size,
-                                 unsigned char* bp,
-                                 unsigned char** out, size_t* outsize) {
+                                 size_t expected_data_size, BitWriter* w) {
   double uncompressedcost = ZopfliCalculateBlockSize(lz77, lstart, lend, 0);
   double fixedcost = ZopfliCalculateBlockSize(lz77, lstart, lend, 1);
-  double dyncost = ZopfliCalculateBlockSize(lz77, lstart, lend, 2);
+  /* Building the dynamic decoding tables is inflate work a fixed block does not
+  have, zlib keeps the fixed ones prebuilt. */
+  double dyncost = ZopfliCalculateBlockSize(lz77, lstart, lend, 2)
+      + options->decodecost * ZOPFLI_DECODE_BLOCK_STEPS;
 
   /* Whether to perform the expensive calculation of creating an optimal block
   with fixed huffman tree to check if smaller. Only do this for small blocks or
@@ -766,9 +971,9 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
   ZopfliLZ77Store fixedstore;
   if (lstart == lend) {
     /* Smallest empty block is represented by fixed block */
-    AddBits(final, 1, bp, out, outsize);
-    AddBits(1, 2, bp, out, outsize);  /* btype 01 */
-    AddBits(0, 7, bp, out, outsize);  /* end symbol has code 0000000 */
+    AddBits(final, 1, w);
+    AddBits(1, 2, w);  /* btype 01 */
+    AddBits(0, 7, w);  /* end symbol has code 0000000 */
     return;
   }
   ZopfliInitLZ77Store(lz77->data, &fixedstore);
@@ -786,18 +991,18 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
 
   if (uncompressedcost < fixedcost && uncompressedcost < dyncost) {
     AddLZ77Block(options, 0, final, lz77, lstart, lend,
-                 expected_data_size, bp, out, outsize);
+                 expected_data_size, w);
   } else if (fixedcost < dyncost) {
     if (expensivefixed) {
       AddLZ77Block(options, 1, final, &fixedstore, 0, fixedstore.size,
-                   expected_data_size, bp, out, outsize);
+                   expected_data_size, w);
     } else {
       AddLZ77Block(options, 1, final, lz77, lstart, lend,
-                   expected_data_size, bp, out, outsize);
+                   expected_data_size, w);
     }
   } else {
     AddLZ77Block(options, 2, final, lz77, lstart, lend,
-                 expected_data_size, bp, out, outsize);
+                 expected_data_size, w);
   }
 
   ZopfliCleanLZ77Store(&fixedstore);
@@ -823,12 +1028,17 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
   size_t* splitpoints = 0;
   double totalcost = 0;
   ZopfliLZ77Store lz77;
+  BitWriter w;
 
   /* If btype=2 is specified, it tries all block types. If a lesser btype is
   given, then however it forces that one. Neither of the lesser types needs
   block splitting as they have no dynamic huffman trees. */
   if (btype == 0) {
-    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
+    InitBitWriter(bp, out, outsize, &w);
+    /* Header of 5 bytes per stored block of up to 65535 bytes. */
+    ReserveBitWriter(&w, inend - instart + 5 * ((inend - instart) / 65535 + 1));
+    AddNonCompressedBlock(options, final, in, instart, inend, &w);
+    FinishBitWriter(&w);
     return;
   } else if (btype == 1) {
     ZopfliLZ77Store store;
@@ -837,8 +1047,9 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     ZopfliInitBlockState(options, instart, inend, 1, &s);
 
     ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
-    AddLZ77Block(options, btype, final, &store, 0, store.size, 0,
-                 bp, out, outsize);
+    InitBitWriter(bp, out, outsize, &w);
+    AddLZ77Block(options, btype, final, &store, 0, store.size, 0, &w);
+    FinishBitWriter(&w);
 
     ZopfliCleanBlockState(&s);
     ZopfliCleanLZ77Store(&store);
@@ -846,63 +1057,89 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
   }
 
 
-  if (options->blocksplitting) {
-    ZopfliBlockSplit(options, in, instart, inend,
-                     options->blocksplittingmax,
-                     &splitpoints_uncompressed, &npoints);
-    splitpoints = (size_t*)malloc(sizeof(*splitpoints) * npoints);
-  }
-
   ZopfliInitLZ77Store(in, &lz77);
 
-  for (i = 0; i <= npoints; i++) {
-    size_t start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
-    size_t end = i == npoints ? inend : splitpoints_uncompressed[i];
+  if (options->fast) {
+    /* One match search, greedy run and cost model run over the whole part,
+    the blocks are then split on the result. */
+    ZopfliOptions fastoptions = *options;
     ZopfliBlockState s;
-    ZopfliLZ77Store store;
-    ZopfliInitLZ77Store(in, &store);
-    ZopfliInitBlockState(options, start, end, 1, &s);
-    ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
-    totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
-
-    ZopfliAppendLZ77Store(&store, &lz77);
-    if (i < npoints) splitpoints[i] = lz77.size;
-
+    fastoptions.matchtable = 1;
+    fastoptions.matchfinder = ZOPFLI_MATCHFINDER_BINARY_TREE;
+    ZopfliInitBlockState(&fastoptions, instart, inend, 0, &s);
+    ZopfliLZ77Optimal(&s, in, instart, inend, 1, &lz77);
     ZopfliCleanBlockState(&s);
-    ZopfliCleanLZ77Store(&store);
-  }
+    if (options->blocksplitting) {
+      ZopfliBlockSplitLZ77(options, &lz77, options->blocksplittingmax,
+                           &splitpoints, &npoints);
+    }
+    for (i = 0; i <= npoints; i++) {
+      size_t start = i == 0 ? 0 : splitpoints[i - 1];
+      size_t end = i == npoints ? lz77.size : splitpoints[i];
+      totalcost += ZopfliCalculateBlockSizeAutoType(&lz77, start, end);
+    }
+  } else {
+    if (options->blocksplitting) {
+      ZopfliBlockSplit(options, in, instart, inend,
+                       options->blocksplittingmax,
+                       &splitpoints_uncompressed, &npoints);
+      splitpoints = (size_t*)malloc(sizeof(*splitpoints) * npoints);
+    }
 
-  /* Second block splitting attempt */
-  if (options->blocksplitting && npoints > 1) {
-    size_t* splitpoints2 = 0;
-    size_t npoints2 = 0;
-    double totalcost2 = 0;
+    for (i = 0; i <= npoints; i++) {
+      size_t start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
+      size_t end = i == npoints ? inend : splitpoints_uncompressed[i];
+      ZopfliBlockState s;
+      ZopfliLZ77Store store;
+      ZopfliInitLZ77Store(in, &store);
+      ZopfliInitBlockState(options, start, end, 1, &s);
+      ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
+      totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
+
+      ZopfliAppendLZ77Store(&store, &lz77);
+      if (i < npoints) splitpoints[i] = lz77.size;
+
+      ZopfliCleanBlockState(&s);
+      ZopfliCleanLZ77Store(&store);
+    }
 
-    ZopfliBlockSplitLZ77(options, &lz77,
-                         options->blocksplittingmax, &splitpoints2, &npoints2);
+    /* Second block splitting attempt */
+    if (options->blocksplitting && npoints > 1) {
+      size_t* splitpoints2 = 0;
+      size_t npoints2 = 0;
+      double totalcost2 = 0;
+      double blockcost = options->decodecost * ZOPFLI_DECODE_BLOCK_STEPS;
 
-    for (i = 0; i <= npoints2; i++) {
-      size_t start = i == 0 ? 0 : splitpoints2[i - 1];
-      size_t end = i == npoints2 ? lz77.size : splitpoints2[i];
-      totalcost2 += ZopfliCalculateBlockSizeAutoType(&lz77, start, end);
-    }
+      ZopfliBlockSplitLZ77(options, &lz77, options->blocksplittingmax,
+                           &splitpoints2, &npoints2);
 
-    if (totalcost2 < totalcost) {
-      free(splitpoints);
-      splitpoints = splitpoints2;
-      npoints = npoints2;
-    } else {
-      free(splitpoints2);
+      for (i = 0; i <= npoints2; i++) {
+        size_t start = i == 0 ? 0 : splitpoints2[i - 1];
+        size_t end = i == npoints2 ? lz77.size : splitpoints2[i];
+        totalcost2 += ZopfliCalculateBlockSizeAutoType(&lz77, start, end);
+      }
+
+      /* Only the difference in block count matters for the decode cost. */
+      if (totalcost2 + npoints2 * blockcost < totalcost + npoints * blockcost) {
+        free(splitpoints);
+        splitpoints = splitpoints2;
+        npoints = npoints2;
+      } else {
+        free(splitpoints2);
+      }
     }
   }
 
+  /* totalcost is in bits. The second split attempt is only used if smaller. */
+  InitBitWriter(bp, out, outsize, &w);
+  ReserveBitWriter(&w, (size_t)(totalcost / 8));
   for (i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? 0 : splitpoints[i - 1];
     size_t end = i == npoints ? lz77.size : splitpoints[i];
     AddLZ77BlockAutoType(options, i == npoints && final,
-                         &lz77, start, end, 0,
-                         bp, out, outsize);
+                         &lz77, start, end, 0, &w);
   }
+  FinishBitWriter(&w);
 
   ZopfliCleanLZ77Store(&lz77);
   free(splitpoints);
@@ -85,6 +85,14 @@ Calculates block size in bits, automatically using the best btype.
 double ZopfliCalculateBlockSizeAutoType(const ZopfliLZ77Store* lz77,
                                         size_t lstart, size_t lend);
 
+/*
+Calculates the inflate work of the symbols of the LZ77 data in bits, as weighed
+by options->decodecost. 0 when decodecost is 0.
+*/
+double ZopfliCalculateDecodeCost(const ZopfliOptions* options,
+                                 const ZopfliLZ77Store* lz77,
+                                 size_t lstart, size_t lend);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
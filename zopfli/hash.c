@@ -40,6 +40,17 @@ void ZopfliAllocHash(size_t window_size, ZopfliHash* h) {
   h->prev2 = (unsigned short*)malloc(sizeof(*h->prev2) * window_size);
   h->hashval2 = (int*)malloc(sizeof(*h->hashval2) * window_size);
 #endif
+
+  h->treehead = 0;
+  h->treeson = 0;
+}
+
+void ZopfliAllocHashTree(size_t window_size, ZopfliHash* h) {
+  h->treehead = (size_t*)malloc(sizeof(*h->treehead) * 65536);
+  h->treeson = (size_t*)malloc(sizeof(*h->treeson) * window_size * 2);
+  if (!h->treehead || !h->treeson) exit(-1); /* Allocation failed. */
+  h->treedepth = ZOPFLI_MAX_TREE_DEPTH;
+  h->treeprune = 0;
 }
 
 void ZopfliResetHash(size_t window_size, ZopfliHash* h) {
@@ -70,6 +81,12 @@ void ZopfliResetHash(size_t window_size, ZopfliHash* h) {
     h->hashval2[i] = -1;
   }
 #endif
+
+  /* The children need no reset: a node is only reachable after it has been
+  inserted again, which sets them. */
+  if (h->treehead) {
+    for (i = 0; i < 65536; i++) h->treehead[i] = 0;
+  }
 }
 
 void ZopfliCleanHash(ZopfliHash* h) {
@@ -86,6 +103,15 @@ void ZopfliCleanHash(ZopfliHash* h) {
 #ifdef ZOPFLI_HASH_SAME
   free(h->same);
 #endif
+
+  ZopfliCleanHashTree(h);
+}
+
+void ZopfliCleanHashTree(ZopfliHash* h) {
+  free(h->treehead);
+  free(h->treeson);
+  h->treehead = 0;
+  h->treeson = 0;
 }
 
 /*
@@ -97,6 +123,84 @@ static void UpdateHashValue(ZopfliHash* h, unsigned char c) {
   h->val = (((h->val) << HASH_SHIFT) ^ (c)) & HASH_MASK;
 }
 
+/*
+Inserts pos in the binary tree of the current hash value, and records the
+matches it passes on the way down in treesublen, the same way the hash chain
+walk of ZopfliFindLongestMatch fills its sublen. This is the binary tree of
+LZMA's BT4 match finder: the nodes visited are the ones that sort closest to
+the new position, most recent first, so for each length the first node that
+reaches it is also the nearest one, and the walk that inserts the position also
+finds its matches. These are exactly the matches the hash chain walk finds, as
+long as no walk was cut off: the nodes below a cut are lost for the positions
+after it. Returns 0 if the walk reached h->treedepth without h->treeprune, the
+tree is then incomplete and must not be used anymore.
+*/
+static int UpdateTree(const unsigned char* array, size_t pos, size_t end,
+                      ZopfliHash* h) {
+  const unsigned char* scan = &array[pos];
+  size_t limit = end - pos < ZOPFLI_MAX_MATCH ? end - pos : ZOPFLI_MAX_MATCH;
+  /* Where to link the next node smaller and larger than pos. */
+  size_t* left = &h->treeson[2 * (pos & ZOPFLI_WINDOW_MASK)];
+  size_t* right = left + 1;
+  /* Common prefix length of pos with everything below left and right. */
+  size_t leftlength = 0, rightlength = 0;
+  size_t node = h->treehead[h->val];
+  int depth = h->treedepth;
+
+  h->treepos = pos;
+  h->treelength = 1;
+  if (limit < ZOPFLI_MIN_MATCH) return 1;  /* Not inserted, nothing can use it. */
+  h->treehead[h->val] = pos + 1;
+
+  for (;;) {
+    size_t dist = pos + 1 - node;
+    size_t* son;
+    const unsigned char* match;
+    size_t length;
+    if (node == 0 || dist >= ZOPFLI_WINDOW_SIZE) {
+      *left = *right = 0;
+      break;
+    }
+    if (depth-- <= 0) {
+      if (!h->treeprune) return 0;
+      *left = *right = 0;
+      break;
+    }
+    son = &h->treeson[2 * ((node - 1) & ZOPFLI_WINDOW_MASK)];
+    match = scan - dist;
+    length = leftlength < rightlength ? leftlength : rightlength;
+    while (length < limit && match[length] == scan[length]) length++;
+
+    if (length > h->treelength) {
+      size_t j;
+      for (j = h->treelength + 1; j <= length; j++) {
+        h->treesublen[j] = (unsigned short)dist;
+      }
+      h->treelength = (unsigned short)length;
+    }
+    if (length == limit) {
+      /* Equal as far as we can tell: pos takes over the node's children. */
+      *left = son[0];
+      *right = son[1];
+      break;
+    }
+    if (match[length] < scan[length]) {
+      *left = node;
+      left = son + 1;
+      node = *left;
+      leftlength = length;
+    } else {
+      *right = node;
+      right = son;
+      node = *right;
+      rightlength = length;
+    }
+  }
+  /* Matches of 1 or 2 bytes only come from hash collisions. */
+  if (h->treelength < ZOPFLI_MIN_MATCH) h->treelength = 1;
+  return 1;
+}
+
 void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
                 ZopfliHash* h) {
   unsigned short hpos = pos & ZOPFLI_WINDOW_MASK;
@@ -134,6 +238,10 @@ void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
   else h->prev2[hpos] = hpos;
   h->head2[h->val2] = hpos;
 #endif
+
+  /* The hash chains are up to date, ZopfliFindLongestMatch walks them for this
+  position and all next ones once the tree is gone. */
+  if (h->treehead && !UpdateTree(array, pos, end, h)) ZopfliCleanHashTree(h);
 }
 
 void ZopfliWarmupHash(const unsigned char* array, size_t pos, size_t end,
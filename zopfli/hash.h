@@ -44,11 +44,45 @@ typedef struct ZopfliHash {
 #ifdef ZOPFLI_HASH_SAME
   unsigned short* same;  /* Amount of repetitions of same byte after this .*/
 #endif
+
+  /*
+  Binary tree match finder, see ZopfliOptions.matchfinder. treehead is null if
+  the hash chains are used instead. There is one tree per hash value, sorted by
+  the bytes that follow each position, with the most recent position at the
+  root. Positions are stored plus one, 0 means no node.
+  */
+  size_t* treehead;  /* Hash value to the root of its tree. */
+  size_t* treeson;  /* Index to the left and right child of its node. */
+  /* Matches found while inserting treepos, like the sublen output of
+  ZopfliFindLongestMatch. */
+  unsigned short treesublen[259];
+  unsigned short treelength;  /* Longest match found, 1 if none. */
+  size_t treepos;
+  /* Maximum nodes visited per position, ZOPFLI_MAX_TREE_DEPTH by default. */
+  int treedepth;
+  /* What happens when a walk reaches treedepth. If true, the nodes below are
+  dropped from the tree, as LZMA does. If false (the default), the whole tree is
+  freed and the hash chains take over, so the matches stay those of the chains. */
+  int treeprune;
 } ZopfliHash;
 
 /* Allocates ZopfliHash memory. */
 void ZopfliAllocHash(size_t window_size, ZopfliHash* h);
 
+/*
+Allocates the binary tree match finder, to be called after ZopfliAllocHash when
+ZopfliOptions.matchfinder is ZOPFLI_MATCHFINDER_BINARY_TREE. From then on every
+ZopfliUpdateHash also inserts the position in the tree, which finds all its
+matches in the same walk, until a walk reaches treedepth, see treeprune.
+*/
+void ZopfliAllocHashTree(size_t window_size, ZopfliHash* h);
+
+/*
+Frees the binary tree match finder, if any. The hash chains are always kept up
+to date, so ZopfliFindLongestMatch continues with those.
+*/
+void ZopfliCleanHashTree(ZopfliHash* h);
+
 /* Resets all fields of ZopfliHash. */
 void ZopfliResetHash(size_t window_size, ZopfliHash* h);
 
@@ -163,17 +163,92 @@ static void ExtractBitLengths(Node* chain, Node* leaves, unsigned* bitlengths) {
 }
 
 /*
-Comparator for sorting the leaves. Has the function signature for qsort.
+The sort packs the symbol index in the low 9 bits of the weight, so there can be
+at most this many symbols. It also bounds the arrays on the stack.
 */
-static int LeafComparator(const void* a, const void* b) {
-  return ((const Node*)a)->weight - ((const Node*)b)->weight;
+#define KATAJAINEN_MAX_SYMBOLS 512
+
+/*
+Comparator for sorting the packed weights. Has the function signature for
+qsort.
+*/
+static int WeightComparator(const void* a, const void* b) {
+  size_t wa = *(const size_t*)a;
+  size_t wb = *(const size_t*)b;
+  return wa < wb ? -1 : (wa > wb ? 1 : 0);
 }
 
-int ZopfliLengthLimitedCodeLengths(
-    const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+/*
+Computes unlimited Huffman code lengths in place, after "In-Place Calculation of
+Minimum-Redundancy Codes" by Alistair Moffat and Jyrki Katajainen. a holds the
+n >= 2 weights in ascending order and is overwritten with their code lengths,
+which are then descending. Needs no memory besides a.
+*/
+static void InPlaceCodeLengths(size_t* a, int n) {
+  int root, leaf, next, avail, used;
+  size_t depth;
+
+  /* Phase 1: build the tree bottom up. The internal nodes overwrite the
+  weights from the front, and keep the index of their parent once combined.
+  On equal weights the internal node goes first, which gives the same lengths
+  as the package-merge below. */
+  a[0] += a[1];
+  root = 0;
+  leaf = 2;
+  for (next = 1; next < n - 1; next++) {
+    /* First child. */
+    if (leaf >= n || a[root] <= a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
+    }
+    /* Second child. */
+    if (leaf >= n || (root < next && a[root] <= a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+
+  /* Phase 2: depth of each internal node, from the parent indexes. */
+  a[n - 2] = 0;
+  for (next = n - 3; next >= 0; next--) {
+    a[next] = a[a[next]] + 1;
+  }
+
+  /* Phase 3: depth of the leaves, from the amount of internal nodes per
+  depth. */
+  avail = 1;
+  used = 0;
+  depth = 0;
+  root = n - 2;
+  next = n - 1;
+  while (avail > 0) {
+    while (root >= 0 && a[root] == depth) {
+      used++;
+      root--;
+    }
+    while (avail > used) {
+      a[next--] = depth;
+      avail--;
+    }
+    avail = 2 * used;
+    depth++;
+    used = 0;
+  }
+}
+
+/*
+Boundary package-merge on the sorted packed weights, for when the unlimited
+code exceeds maxbits.
+*/
+static void PackageMerge(const size_t* sorted, int numsymbols, int maxbits,
+                         unsigned* bitlengths) {
+  Node leaves[KATAJAINEN_MAX_SYMBOLS];
   NodePool pool;
   int i;
-  int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
   int numBoundaryPMRuns;
   Node* nodes;
 
@@ -181,82 +256,95 @@ int ZopfliLengthLimitedCodeLengths(
   a time, so each list is a array of two Node*'s. */
   Node* (*lists)[2];
 
-  /* One leaf per symbol. Only numsymbols leaves will be used. */
-  Node* leaves = (Node*)malloc(n * sizeof(*leaves));
+  for (i = 0; i < numsymbols; i++) {
+    leaves[i].weight = sorted[i] >> 9;
+    leaves[i].count = sorted[i] & 511;
+  }
+
+  /* Initialize node memory pool. */
+  nodes = (Node*)malloc(maxbits * 2 * numsymbols * sizeof(Node));
+  pool.next = nodes;
+
+  lists = (Node* (*)[2])malloc(maxbits * sizeof(*lists));
+  InitLists(&pool, leaves, maxbits, lists);
+
+  /* In the last list, 2 * numsymbols - 2 active chains need to be created. Two
+  are already created in the initialization. Each BoundaryPM run creates one. */
+  numBoundaryPMRuns = 2 * numsymbols - 4;
+  for (i = 0; i < numBoundaryPMRuns - 1; i++) {
+    BoundaryPM(lists, leaves, numsymbols, &pool, maxbits - 1);
+  }
+  BoundaryPMFinal(lists, leaves, numsymbols, &pool, maxbits - 1);
+
+  ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
+
+  free(lists);
+  free(nodes);
+}
+
+int ZopfliLengthLimitedCodeLengths(
+    const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+  /* Weights with the symbol index in the low 9 bits, so that sorting them is
+  stable. Only numsymbols are used. */
+  size_t sorted[KATAJAINEN_MAX_SYMBOLS];
+  size_t lengths[KATAJAINEN_MAX_SYMBOLS];
+  int i;
+  int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
+
+  if (n > KATAJAINEN_MAX_SYMBOLS) return 1;  /* Error, too many symbols. */
 
   /* Initialize all bitlengths at 0. */
   for (i = 0; i < n; i++) {
     bitlengths[i] = 0;
   }
 
-  /* Count used symbols and place them in the leaves. */
+  /* Count used symbols and pack them with their index. */
   for (i = 0; i < n; i++) {
     if (frequencies[i]) {
-      leaves[numsymbols].weight = frequencies[i];
-      leaves[numsymbols].count = i;  /* Index of symbol this leaf represents. */
-      numsymbols++;
+      if (frequencies[i] >=
+          ((size_t)1 << (sizeof(sorted[0]) * CHAR_BIT - 9))) {
+        return 1;  /* Error, we need 9 bits for the count. */
+      }
+      sorted[numsymbols++] = (frequencies[i] << 9) | i;
     }
   }
 
   /* Check special cases and error conditions. */
   if ((1 << maxbits) < numsymbols) {
-    free(leaves);
     return 1;  /* Error, too few maxbits to represent symbols. */
   }
   if (numsymbols == 0) {
-    free(leaves);
     return 0;  /* No symbols at all. OK. */
   }
   if (numsymbols == 1) {
-    bitlengths[leaves[0].count] = 1;
-    free(leaves);
+    bitlengths[sorted[0] & 511] = 1;
     return 0;  /* Only one symbol, give it bitlength 1, not 0. OK. */
   }
   if (numsymbols == 2) {
-    bitlengths[leaves[0].count]++;
-    bitlengths[leaves[1].count]++;
-    free(leaves);
+    bitlengths[sorted[0] & 511]++;
+    bitlengths[sorted[1] & 511]++;
     return 0;
   }
 
-  /* Sort the leaves from lightest to heaviest. Add count into the same
-  variable for stable sorting. */
+  /* Sort the leaves from lightest to heaviest. */
+  qsort(sorted, numsymbols, sizeof(sorted[0]), WeightComparator);
+
+  /* Usually the plain Huffman code already fits in maxbits, it is then also
+  the optimal length limited code. Its longest code is the lightest symbol. */
   for (i = 0; i < numsymbols; i++) {
-    if (leaves[i].weight >=
-        ((size_t)1 << (sizeof(leaves[0].weight) * CHAR_BIT - 9))) {
-      free(leaves);
-      return 1;  /* Error, we need 9 bits for the count. */
-    }
-    leaves[i].weight = (leaves[i].weight << 9) | leaves[i].count;
+    lengths[i] = sorted[i] >> 9;
   }
-  qsort(leaves, numsymbols, sizeof(Node), LeafComparator);
-  for (i = 0; i < numsymbols; i++) {
-    leaves[i].weight >>= 9;
+  InPlaceCodeLengths(lengths, numsymbols);
+  if (lengths[0] <= (size_t)maxbits) {
+    for (i = 0; i < numsymbols; i++) {
+      bitlengths[sorted[i] & 511] = (unsigned)lengths[i];
+    }
+    return 0;  /* OK. */
   }
 
   if (numsymbols - 1 < maxbits) {
     maxbits = numsymbols - 1;
   }
-
-  /* Initialize node memory pool. */
-  nodes = (Node*)malloc(maxbits * 2 * numsymbols * sizeof(Node));
-  pool.next = nodes;
-
-  lists = (Node* (*)[2])malloc(maxbits * sizeof(*lists));
-  InitLists(&pool, leaves, maxbits, lists);
-
-  /* In the last list, 2 * numsymbols - 2 active chains need to be created. Two
-  are already created in the initialization. Each BoundaryPM run creates one. */
-  numBoundaryPMRuns = 2 * numsymbols - 4;
-  for (i = 0; i < numBoundaryPMRuns - 1; i++) {
-    BoundaryPM(lists, leaves, numsymbols, &pool, maxbits - 1);
-  }
-  BoundaryPMFinal(lists, leaves, numsymbols, &pool, maxbits - 1);
-
-  ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
-
-  free(lists);
-  free(leaves);
-  free(nodes);
+  PackageMerge(sorted, numsymbols, maxbits, bitlengths);
   return 0;  /* OK. */
 }
@@ -27,6 +27,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
   store->size = 0;
+  store->capacity = 0;
   store->litlens = 0;
   store->dists = 0;
   store->pos = 0;
@@ -47,48 +48,59 @@ void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
   free(store->d_counts);
 }
 
+void ZopfliResetLZ77Store(ZopfliLZ77Store* store) {
+  store->size = 0;
+}
+
 static size_t CeilDiv(size_t a, size_t b) {
   return (a + b - 1) / b;
 }
 
-void ZopfliCopyLZ77Store(
-    const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
-  size_t i;
-  size_t llsize = ZOPFLI_NUM_LL * CeilDiv(source->size, ZOPFLI_NUM_LL);
-  size_t dsize = ZOPFLI_NUM_D * CeilDiv(source->size, ZOPFLI_NUM_D);
-  ZopfliCleanLZ77Store(dest);
-  ZopfliInitLZ77Store(source->data, dest);
-  dest->litlens =
-      (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
-  dest->pos = (size_t*)malloc(sizeof(*dest->pos) * source->size);
-  dest->ll_symbol =
-      (unsigned short*)malloc(sizeof(*dest->ll_symbol) * source->size);
-  dest->d_symbol =
-      (unsigned short*)malloc(sizeof(*dest->d_symbol) * source->size);
-  dest->ll_counts = (size_t*)malloc(sizeof(*dest->ll_counts) * llsize);
-  dest->d_counts = (size_t*)malloc(sizeof(*dest->d_counts) * dsize);
+void ZopfliReserveLZ77Store(size_t capacity, ZopfliLZ77Store* store) {
+  size_t llsize = ZOPFLI_NUM_LL * CeilDiv(capacity, ZOPFLI_NUM_LL);
+  size_t dsize = ZOPFLI_NUM_D * CeilDiv(capacity, ZOPFLI_NUM_D);
+  if (capacity <= store->capacity) return;
+  store->litlens = (unsigned short*)realloc(store->litlens,
+      sizeof(*store->litlens) * capacity);
+  store->dists = (unsigned short*)realloc(store->dists,
+      sizeof(*store->dists) * capacity);
+  store->pos = (size_t*)realloc(store->pos, sizeof(*store->pos) * capacity);
+  store->ll_symbol = (unsigned short*)realloc(store->ll_symbol,
+      sizeof(*store->ll_symbol) * capacity);
+  store->d_symbol = (unsigned char*)realloc(store->d_symbol,
+      sizeof(*store->d_symbol) * capacity);
+  store->ll_counts = (unsigned*)realloc(store->ll_counts,
+      sizeof(*store->ll_counts) * llsize);
+  store->d_counts = (unsigned*)realloc(store->d_counts,
+      sizeof(*store->d_counts) * dsize);
 
   /* Allocation failed. */
-  if (!dest->litlens || !dest->dists) exit(-1);
-  if (!dest->pos) exit(-1);
-  if (!dest->ll_symbol || !dest->d_symbol) exit(-1);
-  if (!dest->ll_counts || !dest->d_counts) exit(-1);
-
-  dest->size = source->size;
-  for (i = 0; i < source->size; i++) {
-    dest->litlens[i] = source->litlens[i];
-    dest->dists[i] = source->dists[i];
-    dest->pos[i] = source->pos[i];
-    dest->ll_symbol[i] = source->ll_symbol[i];
-    dest->d_symbol[i] = source->d_symbol[i];
-  }
-  for (i = 0; i < llsize; i++) {
-    dest->ll_counts[i] = source->ll_counts[i];
-  }
-  for (i = 0; i < dsize; i++) {
-    dest->d_counts[i] = source->d_counts[i];
-  }
+  if (!store->litlens || !store->dists) exit(-1);
+  if (!store->pos) exit(-1);
+  if (!store->ll_symbol || !store->d_symbol) exit(-1);
+  if (!store->ll_counts || !store->d_counts) exit(-1);
+
+  store->capacity = capacity;
+}
+
+void ZopfliCopyLZ77Store(
+    const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
+  size_t size = source->size;
+  size_t llsize = ZOPFLI_NUM_LL * CeilDiv(size, ZOPFLI_NUM_LL);
+  size_t dsize = ZOPFLI_NUM_D * CeilDiv(size, ZOPFLI_NUM_D);
+  dest->data = source->data;
+  ZopfliResetLZ77Store(dest);
+  ZopfliReserveLZ77Store(size, dest);
+  if (size == 0) return;
+
+  dest->size = size;
+  memcpy(dest->litlens, source->litlens, sizeof(*dest->litlens) * size);
+  memcpy(dest->dists, source->dists, sizeof(*dest->dists) * size);
+  memcpy(dest->pos, source->pos, sizeof(*dest->pos) * size);
+  memcpy(dest->ll_symbol, source->ll_symbol, sizeof(*dest->ll_symbol) * size);
+  memcpy(dest->d_symbol, source->d_symbol, sizeof(*dest->d_symbol) * size);
+  memcpy(dest->ll_counts, source->ll_counts, sizeof(*dest->ll_counts) * llsize);
+  memcpy(dest->d_counts, source->d_counts, sizeof(*dest->d_counts) * dsize);
 }
 
 /*
@@ -97,60 +109,61 @@ context must be a ZopfliLZ77Store*.
 */
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            size_t pos, ZopfliLZ77Store* store) {
-  size_t i;
-  /* Needed for using ZOPFLI_APPEND_DATA multiple times. */
   size_t origsize = store->size;
   size_t llstart = ZOPFLI_NUM_LL * (origsize / ZOPFLI_NUM_LL);
   size_t dstart = ZOPFLI_NUM_D * (origsize / ZOPFLI_NUM_D);
 
+  if (origsize == store->capacity) {
+    /* Grows by doubling, like ZOPFLI_APPEND_DATA, a whole chunk at first. */
+    ZopfliReserveLZ77Store(
+        origsize == 0 ? ZOPFLI_NUM_LL : origsize * 2, store);
+  }
+
   /* Everytime the index wraps around, a new cumulative histogram is made: we're
   keeping one histogram value per LZ77 symbol rather than a full histogram for
   each to save memory. */
   if (origsize % ZOPFLI_NUM_LL == 0) {
-    size_t llsize = origsize;
-    for (i = 0; i < ZOPFLI_NUM_LL; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->ll_counts[origsize - ZOPFLI_NUM_LL + i],
-          &store->ll_counts, &llsize);
+    if (origsize == 0) {
+      memset(store->ll_counts, 0, sizeof(*store->ll_counts) * ZOPFLI_NUM_LL);
+    } else {
+      memcpy(store->ll_counts + llstart,
+             store->ll_counts + llstart - ZOPFLI_NUM_LL,
+             sizeof(*store->ll_counts) * ZOPFLI_NUM_LL);
     }
   }
   if (origsize % ZOPFLI_NUM_D == 0) {
-    size_t dsize = origsize;
-    for (i = 0; i < ZOPFLI_NUM_D; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->d_counts[origsize - ZOPFLI_NUM_D + i],
-          &store->d_counts, &dsize);
+    if (origsize == 0) {
+      memset(store->d_counts, 0, sizeof(*store->d_counts) * ZOPFLI_NUM_D);
+    } else {
+      memcpy(store->d_counts + dstart,
+             store->d_counts + dstart - ZOPFLI_NUM_D,
+             sizeof(*store->d_counts) * ZOPFLI_NUM_D);
     }
   }
 
-  ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(dist, &store->dists, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(pos, &store->pos, &store->size);
   assert(length < 259);
-
+  store->litlens[origsize] = length;
+  store->dists[origsize] = dist;
+  store->pos[origsize] = pos;
   if (dist == 0) {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(length, &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(0, &store->d_symbol, &store->size);
+    store->ll_symbol[origsize] = length;
+    store->d_symbol[origsize] = 0;
     store->ll_counts[llstart + length]++;
   } else {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetLengthSymbol(length),
-                       &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetDistSymbol(dist),
-                       &store->d_symbol, &store->size);
-    store->ll_counts[llstart + ZopfliGetLengthSymbol(length)]++;
-    store->d_counts[dstart + ZopfliGetDistSymbol(dist)]++;
+    int ll_symbol = ZopfliGetLengthSymbol(length);
+    int d_symbol = ZopfliGetDistSymbol(dist);
+    store->ll_symbol[origsize] = ll_symbol;
+    store->d_symbol[origsize] = d_symbol;
+    store->ll_counts[llstart + ll_symbol]++;
+    store->d_counts[dstart + d_symbol]++;
   }
+  store->size = origsize + 1;
 }
 
 void ZopfliAppendLZ77Store(const ZopfliLZ77Store* store,
                            ZopfliLZ77Store* target) {
   size_t i;
+  ZopfliReserveLZ77Store(target->size + store->size, target);
   for (i = 0; i < store->size; i++) {
     ZopfliStoreLitLenDist(store->litlens[i], store->dists[i],
                           store->pos[i], target);
@@ -222,16 +235,26 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
   s->options = options;
   s->blockstart = blockstart;
   s->blockend = blockend;
+  s->matches = 0;
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
-  if (add_lmc) {
+  /* With a match table, the table answers all searches the cache would. */
+  if (add_lmc && !options->matchtable) {
     s->lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
-    ZopfliInitCache(blockend - blockstart, s->lmc);
+    ZopfliInitCache(blockend - blockstart, options->cachelength, s->lmc);
   } else {
     s->lmc = 0;
   }
 #endif
 }
 
+static void CleanMatchTable(ZopfliMatchTable* t) {
+  free(t->offsets);
+  free(t->lengths);
+  free(t->dists);
+  free(t->same);
+  free(t);
+}
+
 void ZopfliCleanBlockState(ZopfliBlockState* s) {
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (s->lmc) {
@@ -239,6 +262,91 @@ void ZopfliCleanBlockState(ZopfliBlockState* s) {
     free(s->lmc);
   }
 #endif
+  if (s->matches) CleanMatchTable(s->matches);
+}
+
+void ZopfliBuildMatchTable(ZopfliBlockState* s, const unsigned char* in,
+                           size_t instart, size_t inend, ZopfliHash* h) {
+  size_t blocksize = inend - instart;
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE
+      ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  unsigned short sublen[259];
+  unsigned short leng;
+  unsigned short dist;
+  size_t i, k;
+  ZopfliMatchTable* t =
+      (ZopfliMatchTable*)malloc(sizeof(ZopfliMatchTable));
+  if (!t) exit(-1); /* Allocation failed. */
+
+  t->start = instart;
+  t->end = inend;
+  t->offsets = (size_t*)malloc(sizeof(*t->offsets) * (blocksize + 1));
+  t->same = (unsigned short*)malloc(sizeof(*t->same) * (blocksize + 1));
+  t->lengths = 0;
+  t->dists = 0;
+  t->size = 0;
+  if (!t->offsets || !t->same) exit(-1); /* Allocation failed. */
+
+  /* The search below must not use a table of a previous range. */
+  if (s->matches) CleanMatchTable(s->matches);
+  s->matches = 0;
+
+  if (instart < inend) {
+    ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
+    ZopfliWarmupHash(in, windowstart, inend, h);
+    for (i = windowstart; i < instart; i++) {
+      ZopfliUpdateHash(in, i, inend, h);
+    }
+  }
+
+  for (i = instart; i < inend; i++) {
+    ZopfliUpdateHash(in, i, inend, h);
+#ifdef ZOPFLI_HASH_SAME
+    t->same[i - instart] = h->same[i & ZOPFLI_WINDOW_MASK];
+#else
+    t->same[i - instart] = 0;
+#endif
+    t->offsets[i - instart] = t->size;
+    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen,
+                           &dist, &leng);
+    for (k = ZOPFLI_MIN_MATCH; k <= leng; k++) {
+      if (k == leng || sublen[k] != sublen[k + 1]) {
+        size_t size = t->size;
+        ZOPFLI_APPEND_DATA(k, &t->lengths, &size);
+        ZOPFLI_APPEND_DATA(sublen[k], &t->dists, &t->size);
+      }
+    }
+  }
+  t->offsets[blocksize] = t->size;
+
+  s->matches = t;
+}
+
+/*
+Gets distance, length and sublen values from the match table, the same as the
+search with this limit would give.
+*/
+static void GetFromMatchTable(const ZopfliMatchTable* t,
+    size_t pos, size_t limit,
+    unsigned short* sublen, unsigned short* distance, unsigned short* length) {
+  size_t i = t->offsets[pos - t->start];
+  size_t end = t->offsets[pos - t->start + 1];
+  unsigned short k = ZOPFLI_MIN_MATCH;
+
+  /* No match of at least ZOPFLI_MIN_MATCH. */
+  *length = 1;
+  *distance = 0;
+
+  for (; i < end; i++) {
+    unsigned short dist = t->dists[i];
+    unsigned short last = t->lengths[i] < limit ? t->lengths[i] : limit;
+    if (sublen) {
+      for (; k <= last; k++) sublen[k] = dist;
+    }
+    *length = last;
+    *distance = dist;
+    if (last == limit) break;
+  }
 }
 
 /*
@@ -350,8 +458,8 @@ static int TryGetFromLongestMatchCache(ZopfliBlockState* s,
       s->lmc->dist[lmcpos] != 0);
   unsigned char limit_ok_for_cache = cache_available &&
       (*limit == ZOPFLI_MAX_MATCH || s->lmc->length[lmcpos] <= *limit ||
-      (sublen && ZopfliMaxCachedSublen(s->lmc,
-          lmcpos, s->lmc->length[lmcpos]) >= *limit));
+      ZopfliMaxCachedSublen(s->lmc,
+          lmcpos, s->lmc->length[lmcpos]) >= *limit);
 
   if (s->lmc && limit_ok_for_cache && cache_available) {
     if (!sublen || s->lmc->length[lmcpos]
@@ -364,6 +472,11 @@ static int TryGetFromLongestMatchCache(ZopfliBlockState* s,
         if (*limit == ZOPFLI_MAX_MATCH && *length >= ZOPFLI_MIN_MATCH) {
           assert(sublen[*length] == s->lmc->dist[lmcpos]);
         }
+      } else if (*length < s->lmc->length[lmcpos]) {
+        /* A shorter match than the longest, its distance is in the sublen. */
+        unsigned short cachedsublen[ZOPFLI_MAX_MATCH + 1];
+        ZopfliCacheToSublen(s->lmc, lmcpos, *length, cachedsublen);
+        *distance = cachedsublen[*length];
       } else {
         *distance = s->lmc->dist[lmcpos];
       }
@@ -394,7 +507,9 @@ static void StoreInLongestMatchCache(ZopfliBlockState* s,
   unsigned char cache_available = s->lmc && (s->lmc->length[lmcpos] == 0 ||
       s->lmc->dist[lmcpos] != 0);
 
-  if (s->lmc && limit == ZOPFLI_MAX_MATCH && sublen && !cache_available) {
+  /* A limit up to the block end is no limit, the result is complete too. */
+  if (s->lmc && (limit == ZOPFLI_MAX_MATCH || pos + limit == s->blockend)
+      && sublen && !cache_available) {
     assert(s->lmc->length[lmcpos] == 1 && s->lmc->dist[lmcpos] == 0);
     s->lmc->dist[lmcpos] = length < ZOPFLI_MIN_MATCH ? 0 : distance;
     s->lmc->length[lmcpos] = length < ZOPFLI_MIN_MATCH ? 0 : length;
@@ -426,6 +541,13 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
   int* hhashval = h->hashval;
   int hval = h->val;
 
+  if (s->matches) {
+    assert(pos >= s->matches->start && pos < s->matches->end);
+    assert(size == s->matches->end);
+    GetFromMatchTable(s->matches, pos, limit, sublen, distance, length);
+    return;
+  }
+
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
     assert(pos + *length <= size);
@@ -451,6 +573,25 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
   arrayend = &array[pos] + limit;
   arrayend_safe = arrayend - 8;
 
+  if (h->treehead) {
+    /* The binary tree already found the matches when pos was inserted. */
+    assert(h->treepos == pos);
+    if (h->treelength >= ZOPFLI_MIN_MATCH) {
+      bestlength = h->treelength < limit ? h->treelength : limit;
+      bestdist = h->treesublen[bestlength];
+      if (sublen) {
+        memcpy(sublen + ZOPFLI_MIN_MATCH, h->treesublen + ZOPFLI_MIN_MATCH,
+               sizeof(*sublen) * (bestlength - ZOPFLI_MIN_MATCH + 1));
+      }
+    }
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+    StoreInLongestMatchCache(s, pos, limit, sublen, bestdist, bestlength);
+#endif
+    *distance = bestdist;
+    *length = bestlength;
+    return;
+  }
+
   assert(hval < 65536);
 
   pp = hhead[hval];  /* During the whole loop, p == hprev[pp]. */
@@ -562,14 +703,17 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
 
   if (instart == inend) return;
 
-  ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
-  ZopfliWarmupHash(in, windowstart, inend, h);
-  for (i = windowstart; i < instart; i++) {
-    ZopfliUpdateHash(in, i, inend, h);
+  /* With a match table, the hash is not needed. */
+  if (!s->matches) {
+    ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
+    ZopfliWarmupHash(in, windowstart, inend, h);
+    for (i = windowstart; i < instart; i++) {
+      ZopfliUpdateHash(in, i, inend, h);
+    }
   }
 
   for (i = instart; i < inend; i++) {
-    ZopfliUpdateHash(in, i, inend, h);
+    if (!s->matches) ZopfliUpdateHash(in, i, inend, h);
 
     ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, dummysublen,
                            &dist, &leng);
@@ -599,7 +743,7 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
         for (j = 2; j < leng; j++) {
           assert(i < inend);
           i++;
-          ZopfliUpdateHash(in, i, inend, h);
+          if (!s->matches) ZopfliUpdateHash(in, i, inend, h);
         }
         continue;
       }
@@ -624,7 +768,7 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
     for (j = 1; j < leng; j++) {
       assert(i < inend);
       i++;
-      ZopfliUpdateHash(in, i, inend, h);
+      if (!s->matches) ZopfliUpdateHash(in, i, inend, h);
     }
   }
 }
@@ -46,23 +46,33 @@ typedef struct ZopfliLZ77Store {
   unsigned short* dists;  /* If 0: indicates literal in corresponding litlens,
       if > 0: length in corresponding litlens, this is the distance. */
   size_t size;
+  size_t capacity;  /* Allocated amount of LZ77 symbols in the arrays. */
 
   const unsigned char* data;  /* original data */
   size_t* pos;  /* position in data where this LZ77 command begins */
 
   unsigned short* ll_symbol;
-  unsigned short* d_symbol;
+  unsigned char* d_symbol;
 
   /* Cumulative histograms wrapping around per chunk. Each chunk has the amount
   of distinct symbols as length, so using 1 value per LZ77 symbol, we have a
   precise histogram at every N symbols, and the rest can be calculated by
-  looping through the actual symbols of this chunk. */
-  size_t* ll_counts;
-  size_t* d_counts;
+  looping through the actual symbols of this chunk. The counts can not exceed
+  the amount of symbols, 32 bits are plenty. */
+  unsigned* ll_counts;
+  unsigned* d_counts;
 } ZopfliLZ77Store;
 
 void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store);
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store);
+/* Empties the store, but keeps its allocation for reuse. */
+void ZopfliResetLZ77Store(ZopfliLZ77Store* store);
+/*
+Makes room for at least capacity LZ77 symbols, so that storing up to that many
+does not reallocate. An LZ77 symbol spans at least one byte, so the byte size of
+the data is always enough.
+*/
+void ZopfliReserveLZ77Store(size_t capacity, ZopfliLZ77Store* store);
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            size_t pos, ZopfliLZ77Store* store);
@@ -78,6 +88,26 @@ void ZopfliLZ77GetHistogram(const ZopfliLZ77Store* lz77,
                             size_t lstart, size_t lend,
                             size_t* ll_counts, size_t* d_counts);
 
+/*
+All matches of a range of positions, as found by ZopfliFindLongestMatch with the
+maximum length limit. For each position, the sublen array is stored as its
+breakpoints: the lengths at which the distance changes, with the distance used
+up to and including that length. This is exact, unlike the longest match cache,
+so once built ZopfliFindLongestMatch answers every search in the range from it
+and the hash is no longer needed.
+*/
+typedef struct ZopfliMatchTable {
+  size_t start;  /* First position in the table. */
+  size_t end;  /* Position after the last one in the table. */
+  size_t* offsets;  /* Index of the first breakpoint of each position, with one
+      extra value at the end. */
+  unsigned short* lengths;  /* Lengths of the breakpoints, ascending for each
+      position. */
+  unsigned short* dists;  /* Distance of the breakpoints. */
+  size_t size;  /* Amount of breakpoints. */
+  unsigned short* same;  /* The same value of the hash, for each position. */
+} ZopfliMatchTable;
+
 /*
 Some state information for compressing a block.
 This is currently a bit under-used (with mainly only the longest match cache),
@@ -91,6 +121,9 @@ typedef struct ZopfliBlockState {
   ZopfliLongestMatchCache* lmc;
 #endif
 
+  /* All matches of the block, or null. See ZopfliBuildMatchTable. */
+  ZopfliMatchTable* matches;
+
   /* The start (inclusive) and end (not inclusive) of the current block. */
   size_t blockstart;
   size_t blockend;
@@ -101,6 +134,15 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
                           ZopfliBlockState* s);
 void ZopfliCleanBlockState(ZopfliBlockState* s);
 
+/*
+Runs the match finder once over instart to inend and stores the result in
+s->matches, which is freed by ZopfliCleanBlockState. After this,
+ZopfliFindLongestMatch and the LZ77 functions in this range get their matches
+from the table and do not use the hash anymore.
+*/
+void ZopfliBuildMatchTable(ZopfliBlockState* s, const unsigned char* in,
+                           size_t instart, size_t inend, ZopfliHash* h);
+
 /*
 Finds the longest match (length and corresponding distance) for LZ77
 compression.
@@ -197,117 +197,228 @@ static double GetCostModelMinCost(CostModelFun* costmodel, void* costcontext) {
   return costmodel(bestlength, bestdist, costcontext);
 }
 
+/*
+The cost model materialized into flat tables, once per squeeze run. Both cost
+models are a sum of a length part and a distance part, so the cost of a match of
+length k at distance d is len[k] + dist[DistBucket(d)], which the forward pass
+gets with two table reads instead of a call through the CostModelFun pointer
+that recomputes symbols and extra bits every time. The decode cost of
+ZopfliOptions.decodecost fits the same split: a step per literal, two per match
+and one more for far distances.
+*/
+typedef struct CostTables {
+  float lit[256];  /* Cost of each literal. */
+  float len[ZOPFLI_MAX_MATCH + 1];  /* Cost of each length, with distance 1. */
+  float dist[512];  /* Extra cost of each distance bucket over distance 1. */
+  double mincost;  /* See GetCostModelMinCost. */
+} CostTables;
+
+/*
+Maps a distance to one of 512 buckets with the same distance symbol, like zlib's
+_dist_code: distances up to 256 are their own bucket, larger ones share a bucket
+per 128, which never crosses a distance symbol boundary.
+*/
+static unsigned DistBucket(unsigned dist) {
+  return dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7);
+}
+
+static void MakeCostTables(CostModelFun* costmodel, void* costcontext,
+                           double decodecost, CostTables* t) {
+  unsigned i;
+  double dist1 = costmodel(ZOPFLI_MIN_MATCH, 1, costcontext);
+  for (i = 0; i < 256; i++) {
+    t->lit[i] = (float)(costmodel(i, 0, costcontext) + decodecost);
+  }
+  t->len[0] = t->len[1] = t->len[2] = 0;
+  for (i = ZOPFLI_MIN_MATCH; i <= ZOPFLI_MAX_MATCH; i++) {
+    t->len[i] = (float)(costmodel(i, 1, costcontext) + 2 * decodecost);
+  }
+  for (i = 0; i < 512; i++) {
+    /* First distance of the bucket. Buckets 256 and 257 are never used. */
+    unsigned dist = i < 256 ? i + 1 : (i - 256) * 128 + 1;
+    double far = dist > ZOPFLI_DECODE_NEAR_DISTANCE ? decodecost : 0;
+    if (i >= 256 && dist < 257) dist = 257;
+    t->dist[i] = (float)(costmodel(ZOPFLI_MIN_MATCH, dist, costcontext) - dist1
+        + far);
+  }
+  /* The cheapest match is a near one, with two decode steps. */
+  t->mincost = GetCostModelMinCost(costmodel, costcontext) + 2 * decodecost;
+}
+
 static size_t zopfli_min(size_t a, size_t b) {
   return a < b ? a : b;
 }
 
 /*
-Performs the forward pass for "squeeze". Gets the most optimal length to reach
-every byte from a previous byte, using cost calculations.
-s: the ZopfliBlockState
-in: the input data array
-instart: where to start
-inend: where to stop (not inclusive)
-costmodel: function to calculate the cost of some lit/len/dist pair.
-costcontext: abstract context for the costmodel function
-length_array: output array of size (inend - instart) which will receive the best
-    length to reach this byte from a previous byte.
-returns the cost that was, according to the costmodel, needed to get to the end.
+Relaxes the match edges leaving one position, for lengths 3 to kend.
+costs and length_array point at that position, so costs[0] is its own cost.
+sublen: distance of the match for each length, see ZopfliFindLongestMatch.
+
+The lengths are visited in runs that share a distance bucket. Within a run the
+distance cost is a constant, so the inner loop is a branch free
+compare-and-select over contiguous arrays that the compiler can vectorize. The
+candidate cost is added up in the same order as a plain loop would, so the
+result does not depend on how the runs are split.
 */
-static double GetBestLengths(ZopfliBlockState *s,
-                             const unsigned char* in,
-                             size_t instart, size_t inend,
-                             CostModelFun* costmodel, void* costcontext,
-                             unsigned short* length_array,
-                             ZopfliHash* h, float* costs) {
-  /* Best cost to get here so far. */
-  size_t blocksize = inend - instart;
-  size_t i = 0, k, kend;
-  unsigned short leng;
-  unsigned short dist;
-  unsigned short sublen[259];
-  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE
-      ? instart - ZOPFLI_WINDOW_SIZE : 0;
-  double result;
-  double mincost = GetCostModelMinCost(costmodel, costcontext);
-  double mincostaddcostj;
-
-  if (instart == inend) return 0;
-
-  ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
-  ZopfliWarmupHash(in, windowstart, inend, h);
-  for (i = windowstart; i < instart; i++) {
-    ZopfliUpdateHash(in, i, inend, h);
+static void RelaxLengths(const CostTables* model, const unsigned short* sublen,
+                         size_t kend, float* costs,
+                         unsigned short* length_array) {
+  double costj = costs[0];
+  double mincostaddcostj = model->mincost + costj;
+  size_t k = ZOPFLI_MIN_MATCH, e;
+  assert(kend <= ZOPFLI_MAX_MATCH);
+  while (k <= kend) {
+    unsigned bucket = DistBucket(sublen[k]);
+    /* Smallest and largest distance of this bucket. */
+    unsigned lo = bucket < 256 ? bucket + 1 : (bucket - 256) * 128 + 1;
+    unsigned hi = bucket < 256 ? bucket + 1 : (bucket - 255) * 128;
+    double distcost = model->dist[bucket];
+    for (e = k + 1; e <= kend && sublen[e] >= lo && sublen[e] <= hi; e++) {}
+    for (; k < e; k++) {
+      double newCost = (double)model->len[k] + distcost + costj;
+      /* Lengths already at the minimum possible cost are left alone. */
+      int better = (costs[k] > mincostaddcostj) & (newCost < costs[k]);
+      costs[k] = better ? (float)newCost : costs[k];
+      length_array[k] = better ? (unsigned short)k : length_array[k];
+    }
   }
+}
 
-  for (i = 1; i < blocksize + 1; i++) costs[i] = ZOPFLI_LARGE_FLOAT;
-  costs[0] = 0;  /* Because it's the start. */
-  length_array[0] = 0;
-
-  for (i = instart; i < inend; i++) {
-    size_t j = i - instart;  /* Index in the costs array and length_array. */
-    ZopfliUpdateHash(in, i, inend, h);
+/*
+Returns whether the searches need the hash: not with a match table, and not
+once the longest match cache has every position of the block.
+*/
+static int NeedsHash(const ZopfliBlockState* s) {
+  if (s->matches) return 0;
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if (s->lmc && s->lmc->complete) return 0;
+#endif
+  return 1;
+}
 
 #ifdef ZOPFLI_SHORTCUT_LONG_REPETITIONS
-    /* If we're in a long repetition of the same character and have more than
-    ZOPFLI_MAX_MATCH characters before and after our position. */
-    if (h->same[i & ZOPFLI_WINDOW_MASK] > ZOPFLI_MAX_MATCH * 2
-        && i > instart + ZOPFLI_MAX_MATCH + 1
-        && i + ZOPFLI_MAX_MATCH * 2 + 1 < inend
-        && h->same[(i - ZOPFLI_MAX_MATCH) & ZOPFLI_WINDOW_MASK]
-            > ZOPFLI_MAX_MATCH) {
-      double symbolcost = costmodel(ZOPFLI_MAX_MATCH, 1, costcontext);
-      /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to
-      the cost corresponding to that length. Doing this, we skip
-      ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */
-      for (k = 0; k < ZOPFLI_MAX_MATCH; k++) {
-        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost;
-        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH;
-        i++;
-        j++;
-        ZopfliUpdateHash(in, i, inend, h);
-      }
-    }
+#define SHORTCUT_LONG_REPETITIONS 1
+
+/* Amount of repetitions of the same byte after pos, see ZopfliHash.same. */
+static unsigned short GetSame(const ZopfliBlockState* s, const ZopfliHash* h,
+                              size_t pos) {
+  if (s->matches) return s->matches->same[pos - s->matches->start];
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  /* The hash is not updated anymore. A complete cache means no position was
+  skipped by the shortcut, so it does not apply anywhere in this block. */
+  if (s->lmc && s->lmc->complete) return 0;
+#endif
+  return h->same[pos & ZOPFLI_WINDOW_MASK];
+}
+#else
+#define SHORTCUT_LONG_REPETITIONS 0
+#define GetSame(s, h, pos) 0
 #endif
 
-    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen,
-                           &dist, &leng);
-
-    /* Literal. */
-    if (i + 1 <= inend) {
-      double newCost = costmodel(in[i], 0, costcontext) + costs[j];
-      assert(newCost >= 0);
-      if (newCost < costs[j + 1]) {
-        costs[j + 1] = newCost;
-        length_array[j + 1] = 1;
-      }
-    }
-    /* Lengths. */
-    kend = zopfli_min(leng, inend-i);
-    mincostaddcostj = mincost + costs[j];
-    for (k = 3; k <= kend; k++) {
-      double newCost;
-
-      /* Calling the cost model is expensive, avoid this if we are already at
-      the minimum possible cost that it can return. */
-     if (costs[j + k] <= mincostaddcostj) continue;
-
-      newCost = costmodel(k, sublen[k], costcontext) + costs[j];
-      assert(newCost >= 0);
-      if (newCost < costs[j + k]) {
-        assert(k <= ZOPFLI_MAX_MATCH);
-        costs[j + k] = newCost;
-        length_array[j + k] = k;
-      }
-    }
-  }
+/* Literal costs of the two cost models, for ZOPFLI_DEFINE_GET_BEST_LENGTHS. */
+#define FIXED_LIT_COST(model, c) ((c) <= 143 ? 8.0f : 9.0f)
+#define STAT_LIT_COST(model, c) ((model)->lit[c])
 
-  assert(costs[blocksize] >= 0);
-  result = costs[blocksize];
+/*
+Performs the forward pass for "squeeze". Gets the most optimal length to reach
+every byte from a previous byte, using cost calculations.
+s: the ZopfliBlockState
+in: the input data array
+instart: where to start
+inend: where to stop (not inclusive)
+model: the cost model tables, see CostTables.
+length_array: output array of size (inend - instart) which will receive the best
+    length to reach this byte from a previous byte.
+returns the cost that was, according to the cost model, needed to get to the
+    end.
 
-  return result;
+This is a macro so that each cost model gets its own instance with the literal
+cost LITCOST(model, c) inlined: GetBestLengthsFixed uses the constant fixed tree
+literal lengths, GetBestLengthsStat the table. They compute the same costs as
+going through the tables for both.
+*/
+#define ZOPFLI_DEFINE_GET_BEST_LENGTHS(name, LITCOST) \
+static double name(ZopfliBlockState *s, \
+                   const unsigned char* in, \
+                   size_t instart, size_t inend, \
+                   const CostTables* model, \
+                   unsigned short* length_array, \
+                   ZopfliHash* h, float* costs) { \
+  /* Best cost to get here so far. */ \
+  size_t blocksize = inend - instart; \
+  size_t i = 0, k, kend; \
+  unsigned short leng; \
+  unsigned short dist; \
+  unsigned short sublen[259]; \
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE \
+      ? instart - ZOPFLI_WINDOW_SIZE : 0; \
+  double result; \
+  int needshash = NeedsHash(s); \
+ \
+  if (instart == inend) return 0; \
+ \
+  if (needshash) { \
+    ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h); \
+    ZopfliWarmupHash(in, windowstart, inend, h); \
+    for (i = windowstart; i < instart; i++) { \
+      ZopfliUpdateHash(in, i, inend, h); \
+    } \
+  } \
+ \
+  for (i = 1; i < blocksize + 1; i++) costs[i] = ZOPFLI_LARGE_FLOAT; \
+  costs[0] = 0;  /* Because it's the start. */ \
+  length_array[0] = 0; \
+ \
+  for (i = instart; i < inend; i++) { \
+    size_t j = i - instart;  /* Index in the costs array and length_array. */ \
+    if (needshash) ZopfliUpdateHash(in, i, inend, h); \
+ \
+    /* If we're in a long repetition of the same character and have more than \
+    ZOPFLI_MAX_MATCH characters before and after our position. */ \
+    if (SHORTCUT_LONG_REPETITIONS \
+        && GetSame(s, h, i) > ZOPFLI_MAX_MATCH * 2 \
+        && i > instart + ZOPFLI_MAX_MATCH + 1 \
+        && i + ZOPFLI_MAX_MATCH * 2 + 1 < inend \
+        && GetSame(s, h, i - ZOPFLI_MAX_MATCH) > ZOPFLI_MAX_MATCH) { \
+      double symbolcost = model->len[ZOPFLI_MAX_MATCH]; \
+      /* Set the length to reach each one to ZOPFLI_MAX_MATCH, and the cost to \
+      the cost corresponding to that length. Doing this, we skip \
+      ZOPFLI_MAX_MATCH values to avoid calling ZopfliFindLongestMatch. */ \
+      for (k = 0; k < ZOPFLI_MAX_MATCH; k++) { \
+        costs[j + ZOPFLI_MAX_MATCH] = costs[j] + symbolcost; \
+        length_array[j + ZOPFLI_MAX_MATCH] = ZOPFLI_MAX_MATCH; \
+        i++; \
+        j++; \
+        if (needshash) ZopfliUpdateHash(in, i, inend, h); \
+      } \
+    } \
+ \
+    ZopfliFindLongestMatch(s, h, in, i, inend, ZOPFLI_MAX_MATCH, sublen, \
+                           &dist, &leng); \
+ \
+    /* Literal. */ \
+    if (i + 1 <= inend) { \
+      double newCost = LITCOST(model, in[i]) + costs[j]; \
+      assert(newCost >= 0); \
+      if (newCost < costs[j + 1]) { \
+        costs[j + 1] = newCost; \
+        length_array[j + 1] = 1; \
+      } \
+    } \
+    /* Lengths. */ \
+    kend = zopfli_min(leng, inend-i); \
+    RelaxLengths(model, sublen, kend, costs + j, length_array + j); \
+  } \
+ \
+  assert(costs[blocksize] >= 0); \
+  result = costs[blocksize]; \
+ \
+  return result; \
 }
 
+ZOPFLI_DEFINE_GET_BEST_LENGTHS(GetBestLengthsFixed, FIXED_LIT_COST)
+ZOPFLI_DEFINE_GET_BEST_LENGTHS(GetBestLengthsStat, STAT_LIT_COST)
+
 /*
 Calculates the optimal path of lz77 lengths to use, from the calculated
 length_array. The length_array must contain the optimal length to reach that
@@ -344,13 +455,16 @@ static void FollowPath(ZopfliBlockState* s,
       ? instart - ZOPFLI_WINDOW_SIZE : 0;
 
   size_t total_length_test = 0;
+  int needshash = NeedsHash(s);
 
   if (instart == inend) return;
 
-  ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
-  ZopfliWarmupHash(in, windowstart, inend, h);
-  for (i = windowstart; i < instart; i++) {
-    ZopfliUpdateHash(in, i, inend, h);
+  if (needshash) {
+    ZopfliResetHash(ZOPFLI_WINDOW_SIZE, h);
+    ZopfliWarmupHash(in, windowstart, inend, h);
+    for (i = windowstart; i < instart; i++) {
+      ZopfliUpdateHash(in, i, inend, h);
+    }
   }
 
   pos = instart;
@@ -360,7 +474,7 @@ static void FollowPath(ZopfliBlockState* s,
     unsigned short dist;
     assert(pos < inend);
 
-    ZopfliUpdateHash(in, pos, inend, h);
+    if (needshash) ZopfliUpdateHash(in, pos, inend, h);
 
     /* Add to output. */
     if (length >= ZOPFLI_MIN_MATCH) {
@@ -380,7 +494,7 @@ static void FollowPath(ZopfliBlockState* s,
 
 
     assert(pos + length <= inend);
-    for (j = 1; j < length; j++) {
+    for (j = 1; j < length && needshash; j++) {
       ZopfliUpdateHash(in, pos + j, inend, h);
     }
 
@@ -432,8 +546,31 @@ static double LZ77OptimalRun(ZopfliBlockState* s,
     unsigned short* length_array, CostModelFun* costmodel,
     void* costcontext, ZopfliLZ77Store* store,
     ZopfliHash* h, float* costs) {
-  double cost = GetBestLengths(s, in, instart, inend, costmodel,
-                costcontext, length_array, h, costs);
+  CostTables model;
+  double cost;
+  MakeCostTables(costmodel, costcontext, s->options->decodecost, &model);
+  /* The fixed instance has the literal costs built in, without decode cost. */
+  if (costmodel == GetCostFixed && s->options->decodecost <= 0) {
+    cost = GetBestLengthsFixed(s, in, instart, inend, &model, length_array, h,
+                               costs);
+  } else {
+    cost = GetBestLengthsStat(s, in, instart, inend, &model, length_array, h,
+                              costs);
+  }
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  /* The forward pass searched every position with the full length limit, so
+  from now on the longest match cache answers the searches. Keeping the binary
+  tree would cost a tree walk per position and run for nothing, the hash chains
+  handle the positions the cache could not keep. Once the cache has them all,
+  the next runs skip the hash too. */
+  if (s->lmc) {
+    ZopfliCleanHashTree(h);
+    if (!s->lmc->complete) {
+      s->lmc->complete = ZopfliCacheComplete(s->lmc, instart - s->blockstart,
+          inend - s->blockstart, s->blockend - s->blockstart);
+    }
+  }
+#endif
   free(*path);
   *path = 0;
   *pathsize = 0;
@@ -457,6 +594,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   ZopfliHash hash;
   ZopfliHash* h = &hash;
   SymbolStats stats, beststats, laststats;
+  ZopfliStatsPrior* prior = s->options->warmstart;
   int i;
   float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
   double cost;
@@ -472,38 +610,76 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   InitRanState(&ran_state);
   InitStats(&stats);
   ZopfliInitLZ77Store(in, &currentstore);
+  ZopfliReserveLZ77Store(blocksize, &currentstore);
   ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  if (s->options->matchfinder == ZOPFLI_MATCHFINDER_BINARY_TREE) {
+    ZopfliAllocHashTree(ZOPFLI_WINDOW_SIZE, h);
+    if (s->options->fast) {
+      h->treedepth = ZOPFLI_FAST_TREE_DEPTH;
+      h->treeprune = 1;
+    }
+  }
+  if (s->options->matchtable && numiterations > 0) {
+    /* Search once, all runs below only do the cost DP and the traceback. */
+    ZopfliBuildMatchTable(s, in, instart, inend, h);
+    ZopfliCleanHashTree(h);
+  }
 
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
 
-  /* Initial run. */
-  ZopfliLZ77Greedy(s, in, instart, inend, &currentstore, h);
-  GetStatistics(&currentstore, &stats);
+  if (prior && prior->valid && numiterations > 0) {
+    /* Start from what the previous block converged to, no greedy run. */
+    memcpy(stats.litlens, prior->litlens, sizeof(stats.litlens));
+    memcpy(stats.dists, prior->dists, sizeof(stats.dists));
+    stats.litlens[256] = 1;  /* End symbol. */
+    CalculateStatistics(&stats);
+  } else {
+    /* Initial run. */
+    ZopfliLZ77Greedy(s, in, instart, inend, &currentstore, h);
+    GetStatistics(&currentstore, &stats);
+    if (numiterations < 1) {
+      /* No iterations, the greedy result is the output. */
+      ZopfliLZ77Store swap = *store;
+      *store = currentstore;
+      currentstore = swap;
+      currentstore.data = in;
+    }
+  }
 
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
   for (i = 0; i < numiterations; i++) {
-    ZopfliCleanLZ77Store(&currentstore);
-    ZopfliInitLZ77Store(in, &currentstore);
+    int improved = 0;
+    ZopfliResetLZ77Store(&currentstore);
+    ZopfliReserveLZ77Store(blocksize, &currentstore);
     LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
                    length_array, GetCostStat, (void*)&stats,
                    &currentstore, h, costs);
-    cost = ZopfliCalculateBlockSize(&currentstore, 0, currentstore.size, 2);
+    cost = ZopfliCalculateBlockSize(&currentstore, 0, currentstore.size, 2)
+        + ZopfliCalculateDecodeCost(s->options, &currentstore,
+                                    0, currentstore.size);
 #ifdef _VERBOSE
     if (s->options->verbose_more || (s->options->verbose && cost < bestcost)) {
       fprintf(stderr, "Iteration %d: %d bit\n", i, (int) cost);
     }
 #endif
     if (cost < bestcost) {
-      /* Copy to the output store. */
-      ZopfliCopyLZ77Store(&currentstore, store);
       CopyStats(&stats, &beststats);
       bestcost = cost;
+      improved = 1;
     }
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
     GetStatistics(&currentstore, &stats);
+    if (improved) {
+      /* Swap into the output store instead of copying, the previous best
+      becomes the buffer of the next run. */
+      ZopfliLZ77Store swap = *store;
+      *store = currentstore;
+      currentstore = swap;
+      currentstore.data = in;
+    }
     if (lastrandomstep != -1) {
       /* This makes it converge slower but better. Do it only once the
       randomness kicks in so that if the user does few iterations, it gives a
@@ -520,6 +696,14 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     lastcost = cost;
   }
 
+  if (prior) {
+    ClearStatFreqs(&stats);
+    GetStatistics(store, &stats);
+    memcpy(prior->litlens, stats.litlens, sizeof(prior->litlens));
+    memcpy(prior->dists, stats.dists, sizeof(prior->dists));
+    prior->valid = 1;
+  }
+
   free(length_array);
   free(path);
   free(costs);
@@ -545,10 +729,19 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
 
+  ZopfliReserveLZ77Store(store->size + blocksize, store);
   ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  if (s->options->matchfinder == ZOPFLI_MATCHFINDER_BINARY_TREE) {
+    ZopfliAllocHashTree(ZOPFLI_WINDOW_SIZE, h);
+  }
 
   s->blockstart = instart;
   s->blockend = inend;
+  if (s->options->matchtable) {
+    /* Also saves the searches of FollowPath. */
+    ZopfliBuildMatchTable(s, in, instart, inend, h);
+    ZopfliCleanHashTree(h);
+  }
 
   /* Shortest path for fixed tree This one should give the shortest possible
   result for fixed tree, no repeated runs are needed since the tree is known. */
@@ -36,7 +36,8 @@ solution.
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
-dictionary.
+dictionary. With numiterations 0, outputs the greedy LZ77 that the iterations
+start from, as a quick first estimate.
 */
 void ZopfliLZ77Optimal(ZopfliBlockState *s,
                        const unsigned char* in, size_t instart, size_t inend,
@@ -32,4 +32,11 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->matchfinder = ZOPFLI_MATCHFINDER_HASH_CHAIN;
+  options->matchtable = 0;
+  options->blocksplittingthreads = 1;
+  options->warmstart = 0;
+  options->cachelength = ZOPFLI_CACHE_LENGTH;
+  options->fast = 0;
+  options->decodecost = 0;
 }
@@ -69,7 +69,7 @@ For longest match cache. max 256. Uses huge amounts of memory but makes it
 faster. Uses this many times three bytes per single byte of the input data.
 This is so because longest match finding has to find the exact distance
 that belongs to each length for the best lz77 strategy.
-Good values: e.g. 5, 8.
+Good values: e.g. 5, 8. This is the default of ZopfliOptions.cachelength.
 */
 #define ZOPFLI_CACHE_LENGTH 8
 
@@ -83,6 +83,38 @@ Good value: e.g. 8192.
 */
 #define ZOPFLI_MAX_CHAIN_HITS 8192
 
+/*
+Maximum amount of nodes the binary tree match finder visits per position, see
+ZopfliOptions.matchfinder. The tree walk only visits nodes that sort close to
+the current position, so this can be far lower than ZOPFLI_MAX_CHAIN_HITS. Only
+degenerate trees reach it, such as counters where each new position sorts after
+all earlier ones; the hash chains then take over for the rest of the pass.
+*/
+#define ZOPFLI_MAX_TREE_DEPTH 256
+
+/*
+Tree depth used by ZopfliOptions.fast. With a single cost model run the deeper
+searches make no measurable difference in size. Walks that reach it prune the
+tree instead of falling back to the hash chains.
+*/
+#define ZOPFLI_FAST_TREE_DEPTH 48
+
+/*
+Inflate work of a dynamic block besides its symbols, in decode steps, see
+ZopfliOptions.decodecost: decoding the code length codes and filling zlib's 9
+and 6 bit root tables. A rough estimate, it only has to keep the splitter from
+adding blocks for a few bytes.
+*/
+#define ZOPFLI_DECODE_BLOCK_STEPS 600
+
+/*
+Matches farther than this cost an extra decode step with
+ZopfliOptions.decodecost, their source is less likely to still be in the data
+cache of a small device. A multiple of 128, so it falls on a boundary of the
+squeeze distance buckets.
+*/
+#define ZOPFLI_DECODE_NEAR_DISTANCE 8192
+
 /*
 Whether to use the longest match cache for ZopfliFindLongestMatch. This cache
 consumes a lot of memory but speeds it up. No effect on compression size.
@@ -22,36 +22,22 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #include <stdio.h>
 
+#include "checksum.h"
 #include "deflate.h"
 
 
-/* Calculates the adler32 checksum of the data */
-static unsigned adler32(const unsigned char* data, size_t size)
-{
-  static const unsigned sums_overflow = 5550;
-  unsigned s1 = 1;
-  unsigned s2 = 1 >> 16;
-
-  while (size > 0) {
-    size_t amount = size > sums_overflow ? sums_overflow : size;
-    size -= amount;
-    while (amount > 0) {
-      s1 += (*data++);
-      s2 += s1;
-      amount--;
-    }
-    s1 %= 65521;
-    s2 %= 65521;
-  }
-
-  return (s2 << 16) | s1;
-}
-
 void ZopfliZlibCompress(const ZopfliOptions* options,
                         const unsigned char* in, size_t insize,
                         unsigned char** out, size_t* outsize) {
+  ZopfliZlibCompressAdler32(options, in, insize,
+      ZopfliUpdateAdler32(ZOPFLI_ADLER32_INIT, in, insize), out, outsize);
+}
+
+void ZopfliZlibCompressAdler32(const ZopfliOptions* options,
+                               const unsigned char* in, size_t insize,
+                               unsigned checksum,
+                               unsigned char** out, size_t* outsize) {
   unsigned char bitpointer = 0;
-  unsigned checksum = adler32(in, (unsigned)insize);
   unsigned cmf = 120;  /* CM 8, CINFO 7. See zlib spec.*/
   unsigned flevel = 3;
   unsigned fdict = 0;
@@ -43,6 +43,15 @@ void ZopfliZlibCompress(const ZopfliOptions* options,
                         const unsigned char* in, size_t insize,
                         unsigned char** out, size_t* outsize);
 
+/*
+Same as ZopfliZlibCompress, but with the adler32 of the input already computed
+by the caller, e.g. with ZopfliUpdateAdler32 while the input was being read.
+*/
+void ZopfliZlibCompressAdler32(const ZopfliOptions* options,
+                               const unsigned char* in, size_t insize,
+                               unsigned checksum,
+                               unsigned char** out, size_t* outsize);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
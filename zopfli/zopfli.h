@@ -27,6 +27,25 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Symbol counts carried from one block to the next, see ZopfliOptions.warmstart.
+Zero initialize it before the first block of a file.
+*/
+typedef struct ZopfliStatsPrior {
+  /* Whether the counts below are set. */
+  int valid;
+  /* Lit/len symbol counts of the last squeezed block. */
+  size_t litlens[288];
+  /* Dist symbol counts of the last squeezed block. */
+  size_t dists[32];
+} ZopfliStatsPrior;
+
+/* Match finders for ZopfliOptions.matchfinder. */
+typedef enum {
+  ZOPFLI_MATCHFINDER_HASH_CHAIN,
+  ZOPFLI_MATCHFINDER_BINARY_TREE
+} ZopfliMatchFinder;
+
 /*
 Options used throughout the program.
 */
@@ -40,7 +59,8 @@ typedef struct ZopfliOptions {
   /*
   Maximum amount of times to rerun forward and backward pass to optimize LZ77
   compression cost. Good values: 10, 15 for small files, 5 for files over
-  several MB in size or it will be too slow.
+  several MB in size or it will be too slow. 0 only does the greedy LZ77 that
+  the iterations start from, which is fast and close to zlib -9.
   */
   int numiterations;
 
@@ -61,6 +81,74 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  Match finder for the LZ77 searches, a ZopfliMatchFinder. The hash chains walk
+  up to ZOPFLI_MAX_CHAIN_HITS earlier positions with the same hash, which is
+  most of the runtime on repetitive data. The binary tree finds the matches of
+  every length while inserting each position, visiting only positions that sort
+  close to it. Both give the nearest match of each length, so the output is the
+  same, except where the chains stop at ZOPFLI_MAX_CHAIN_HITS before reaching
+  a match the tree finds. Default: ZOPFLI_MATCHFINDER_HASH_CHAIN.
+  */
+  int matchfinder;
+
+  /*
+  If true, ZopfliLZ77Optimal and ZopfliLZ77OptimalFixed run the match finder
+  once per block and keep all its matches in a table, see ZopfliMatchTable. The
+  iterations then only run the cost model and the traceback, without resetting
+  and replaying the hash each time. Replaces the longest match cache, and gives
+  the same result. Default: false (0).
+  */
+  int matchtable;
+
+  /*
+  Maximum amount of threads the block splitter computes the exact cost of its
+  candidate split points with, for blocks large enough to be worth it. The
+  split points are the same for any amount. Default: 1.
+  */
+  int blocksplittingthreads;
+
+  /*
+  If not NULL and valid, ZopfliLZ77Optimal starts the iterations of each block
+  from these statistics instead of from a greedy LZ77 run, and stores the
+  statistics of its result back. Consecutive blocks of one file usually have
+  similar statistics, so fewer iterations reach the same size. Must not be
+  shared by blocks compressed at the same time. Default: NULL.
+  */
+  ZopfliStatsPrior* warmstart;
+
+  /*
+  Amount of sublen breakpoints the longest match cache keeps per position,
+  using three bytes of memory each per input byte. Once every position of a
+  block fits, the squeeze iterations take all matches from the cache and skip
+  replaying the hash. Unused with matchtable. Default: ZOPFLI_CACHE_LENGTH (8).
+  */
+  int cachelength;
+
+  /*
+  If true, compresses each part with a single search and cost model run
+  instead of the iterations: the matches are found once, a greedy LZ77 gives
+  the symbol costs, one shortest path run with those costs gives the LZ77, and
+  the blocks are split on that. Always uses the binary tree with a lower depth,
+  numiterations, matchfinder and matchtable are ignored. About 0.5% larger than
+  15 iterations with the binary tree and match table, at a fifth of the time.
+  Default: false (0).
+  */
+  int fast;
+
+  /*
+  Weight in bits of one step of inflate work, for targets where inflating costs
+  more time than reading the extra bytes. Each Huffman symbol inflate decodes,
+  a literal or the length and the distance of a match, costs this many bits on
+  top of its size, and so does a match farther than ZOPFLI_DECODE_NEAR_DISTANCE.
+  Each additional dynamic block costs ZOPFLI_DECODE_BLOCK_STEPS steps for
+  building its decoding tables. The squeeze cost model, the choice of the best
+  iteration, the block splitter and the choice between fixed and dynamic trees
+  all use it, which gives fewer and longer symbols and fewer blocks for a bit
+  of size. Default: 0, size only.
+  */
+  double decodecost;
 } ZopfliOptions;
 
 /* Initializes options with default values. */
@@ -160,10 +160,27 @@ int main(int argc, char* argv[]) {
     else if (StringsEqual(arg, "--zlib")) output_type = ZOPFLI_FORMAT_ZLIB;
     else if (StringsEqual(arg, "--gzip")) output_type = ZOPFLI_FORMAT_GZIP;
     else if (StringsEqual(arg, "--splitlast"))  /* Ignore */;
+    else if (StringsEqual(arg, "--bintree")) {
+      options.matchfinder = ZOPFLI_MATCHFINDER_BINARY_TREE;
+    }
+    else if (StringsEqual(arg, "--matchtable")) options.matchtable = 1;
+    else if (StringsEqual(arg, "--fast")) options.fast = 1;
+    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'c'
+        && arg[3] >= '0' && arg[3] <= '9') {
+      options.cachelength = atoi(arg + 3);
+    }
+    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 't'
+        && arg[3] >= '0' && arg[3] <= '9') {
+      options.blocksplittingthreads = atoi(arg + 3);
+    }
     else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'i'
         && arg[3] >= '0' && arg[3] <= '9') {
       options.numiterations = atoi(arg + 3);
     }
+    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'd'
+        && arg[3] >= '0' && arg[3] <= '9') {
+      options.decodecost = atof(arg + 3);
+    }
     else if (StringsEqual(arg, "-h")) {
       fprintf(stderr,
           "Usage: zopfli [OPTION]... FILE...\n"
@@ -179,12 +196,23 @@ int main(int argc, char* argv[]) {
           "  --zlib        output to zlib format instead of gzip\n"
           "  --deflate     output to deflate format instead of gzip\n"
           "  --splitlast   ignored, left for backwards compatibility\n");
+      fprintf(stderr,
+          "  --bintree     find matches with a binary tree instead of hash"
+          " chains\n"
+          "  --matchtable  find the matches of each block once for all"
+          " iterations\n"
+          "  --fast        single pass near optimal parse, much faster\n"
+          "  --t#          block splitter threads (default 1), e.g. --t4\n"
+          "  --c#          longest match cache entries per position (default"
+          " 8), e.g. --c16\n"
+          "  --d#          bits of size one inflate step is worth (default 0),"
+          " e.g. --d2\n");
       return 0;
     }
   }
 
-  if (options.numiterations < 1) {
-    fprintf(stderr, "Error: must have 1 or more iterations\n");
+  if (options.numiterations < 0) {
+    fprintf(stderr, "Error: must have 0 or more iterations\n");
     return 0;
   }
 